@@ -0,0 +1,120 @@
+//Deferred binary logging into a lock-free RAM ring.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "blog.h"
+
+/*
+Writers reserve a slot by incrementing wr_idx, fill it in and then set the slot seq to
+their index+1. A seq that doesn't match the index a reader expects means the slot is
+either still being written, or has been overwritten by a writer that lapped the ring;
+the ring is lossy, newest records win.
+*/
+typedef struct {
+	atomic_uint seq;
+	blog_rec_t rec;
+} slot_t;
+
+static slot_t ring[BLOG_RING_SIZE];
+static atomic_uint wr_idx;
+static atomic_uint dropped;
+
+#define PRINT_INTERVAL_MS 200
+
+void IRAM_ATTR blog_write(blog_site_t *site, uint32_t interval_ms, const char *fmt, int nargs, ...) {
+	uint32_t now=esp_timer_get_time();
+	blog_rec_t rec={.ts_us=now, .fmt=(uint32_t)(uintptr_t)fmt, .nargs=nargs};
+	if (site) {
+		//Racy if the same call site runs in two tasks at once; worst case is an extra
+		//record or a miscount, which is fine for a rate limiter.
+		if (site->last_us!=0 && now-site->last_us<interval_ms*1000) {
+			if (site->suppressed!=0xffff) site->suppressed++;
+			return;
+		}
+		site->last_us=now?now:1;
+		rec.suppressed=site->suppressed;
+		site->suppressed=0;
+	}
+	va_list ap;
+	va_start(ap, nargs);
+	for (int i=0; i<nargs && i<4; i++) rec.arg[i]=va_arg(ap, uint32_t);
+	va_end(ap);
+
+	uint32_t i=atomic_fetch_add(&wr_idx, 1);
+	slot_t *s=&ring[i%BLOG_RING_SIZE];
+	atomic_store(&s->seq, 0);
+	s->rec=rec;
+	atomic_store(&s->seq, i+1);
+}
+
+//Copy out the record with index idx. Returns 1 if it's there, 0 if it's still being
+//written, -1 if it has been overwritten.
+static int get_rec(uint32_t idx, blog_rec_t *rec) {
+	slot_t *s=&ring[idx%BLOG_RING_SIZE];
+	int32_t d=atomic_load(&s->seq)-(idx+1);
+	if (d<0) return 0;
+	if (d>0) return -1;
+	*rec=s->rec;
+	//Re-check: a writer may have lapped us while copying.
+	if (atomic_load(&s->seq)!=idx+1) return -1;
+	return 1;
+}
+
+static void print_rec(const blog_rec_t *r) {
+	printf("B (%lu) ", (unsigned long)(r->ts_us/1000));
+	printf((const char*)(uintptr_t)r->fmt, r->arg[0], r->arg[1], r->arg[2], r->arg[3]);
+	if (r->suppressed) printf(" [%d suppressed]", r->suppressed);
+	printf("\n");
+}
+
+static void blog_task(void *arg) {
+	uint32_t rd=atomic_load(&wr_idx);
+	while(1) {
+		vTaskDelay(pdMS_TO_TICKS(PRINT_INTERVAL_MS));
+		uint32_t w=atomic_load(&wr_idx);
+		if (w-rd>BLOG_RING_SIZE) {
+			atomic_fetch_add(&dropped, w-rd-BLOG_RING_SIZE);
+			rd=w-BLOG_RING_SIZE;
+		}
+		while (rd!=w) {
+			blog_rec_t rec;
+			int r=get_rec(rd, &rec);
+			if (r==0) break; //writer still busy; get it next time
+			if (r<0) {
+				atomic_fetch_add(&dropped, 1);
+			} else {
+				print_rec(&rec);
+			}
+			rd++;
+		}
+	}
+}
+
+void blog_start() {
+	xTaskCreate(blog_task, "blog", 3072, NULL, 1, NULL);
+}
+
+int blog_snapshot(blog_rec_t *out, int max, uint32_t *drop) {
+	uint32_t w=atomic_load(&wr_idx);
+	uint32_t n=(w<BLOG_RING_SIZE)?w:BLOG_RING_SIZE;
+	if (n>max) n=max;
+	int ct=0;
+	for (uint32_t idx=w-n; idx!=w; idx++) {
+		if (get_rec(idx, &out[ct])==1) ct++;
+	}
+	*drop=atomic_load(&dropped);
+	return ct;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Deferred binary logging. BLOG() doesn't format anything: it stores a timestamp, the
+address of the format string and up to 4 arguments in a lock-free ring in RAM, which
+is cheap enough to leave on everywhere, including in ISRs. A low-priority task formats
+and prints the records later; the ring can also be downloaded from /blog and decoded on
+a PC against the firmware ELF file (tools/blog_decode).
+
+Because formatting happens later, the format must be a string literal and the arguments
+must be 32-bit values: ints, or pointers to string literals for %s.
+
+BLOG_RL() is rate-limited per call site: it logs at most once every interval_ms, and
+the next record that does get through says how many were suppressed in between.
+*/
+
+typedef struct {
+	uint32_t ts_us;		//esp_timer time, lower 32 bits
+	uint32_t fmt;		//Address of the format string
+	uint16_t suppressed;	//Rate-limited records dropped at this call site before this one
+	uint8_t nargs;
+	uint8_t reserved;
+	uint32_t arg[4];
+} blog_rec_t;
+
+//Header of the /blog download; followed by nrec records, oldest first.
+#define BLOG_MAGIC 0x474f4c42 //'BLOG'
+typedef struct {
+	uint32_t magic;
+	uint16_t rec_size;	//sizeof(blog_rec_t)
+	uint16_t nrec;
+	uint32_t dropped;	//Records overwritten before they were printed
+	char elf_sha[16];	//Start of the SHA256 of the ELF file the format addresses refer to
+} blog_dump_hdr_t;
+
+typedef struct {
+	uint32_t last_us;
+	uint16_t suppressed;
+} blog_site_t;
+
+void blog_write(blog_site_t *site, uint32_t interval_ms, const char *fmt, int nargs, ...);
+
+#define BLOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+#define BLOG_NARGS(...) BLOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+
+#define BLOG(fmt, ...) blog_write(NULL, 0, fmt, BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#define BLOG_RL(interval_ms, fmt, ...) do { \
+		static blog_site_t site_; \
+		blog_write(&site_, interval_ms, fmt, BLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+	} while(0)
+
+//Start the low-priority task that prints the records on the console.
+void blog_start();
+
+//Copy the records currently in the ring, oldest first. Returns the amount copied;
+//dropped gets the amount of records overwritten before the print task got to them.
+int blog_snapshot(blog_rec_t *out, int max, uint32_t *dropped);
+
+#define BLOG_RING_SIZE 128
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,6 +3,9 @@
 
 
 #include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "sdkconfig.h"
 #include "usbpd_esp.h"
 #include "esp_log.h"
 #include "fusb302b.h"
@@ -11,6 +14,7 @@
 #include "esp_timer.h"
 #include "esp_check.h"
 #include "driver/gpio.h"
+#include "blog.h"
 
 extern "C" {
 
@@ -21,31 +25,38 @@ static FUSB302 *fusb;
 static PolicyEngine *pe;
 static usbpd_esp_cb_t callback;
 
+//PPS sink range as set by usbpd_esp_set_pps_range(); pps_sink_max_mv==0 means PPS is off.
+static int pps_sink_min_mv, pps_sink_max_mv, pps_sink_ma;
+//Requested PPS voltage, and the usable range of the APDO we're on (pps_active)
+static volatile int pps_req_mv;
+static volatile int pps_active, pps_min_mv, pps_max_mv;
+static volatile int renegotiate_pending;
+
+//Time spent talking to the FUSB302, for the negotiation report
+static int64_t init_time;
+static uint32_t i2c_xfers;
+static int64_t i2c_us;
+
 static bool fusb_rd(const uint8_t deviceAddr, const uint8_t registerAdd, const uint8_t size, uint8_t *buf) {
+	int64_t t=esp_timer_get_time();
 	esp_err_t r=i2c_master_write_read_device(port, deviceAddr>>1, &registerAdd, 1, buf, size, pdMS_TO_TICKS(100));
+	i2c_us+=esp_timer_get_time()-t;
+	i2c_xfers++;
 	if (r!=ESP_OK) ESP_LOGE(TAG, "fusb_rd: i2c returned error");
 	return (r==ESP_OK);
 }
 
 static bool fusb_wr(const uint8_t deviceAddr, const uint8_t registerAdd, const uint8_t size, uint8_t *buf) {
 //	ESP_LOGI(TAG, "Writing %d bytes to addr 0x%02X", size, registerAdd);
-/*
-	for (int i=0; i<size; i++) {
-		printf("%02X ", buf[i]);
-	}
-	printf("\n");
-*/
-	i2c_cmd_handle_t h=i2c_cmd_link_create();
-	ESP_ERROR_CHECK(i2c_master_start(h));
-	ESP_ERROR_CHECK(i2c_master_write_byte(h, deviceAddr|I2C_MASTER_WRITE, true));
-	ESP_ERROR_CHECK(i2c_master_write_byte(h, registerAdd, true));
-	for (int i=0; i<size; i++) {
-		ESP_ERROR_CHECK(i2c_master_write_byte(h, buf[i], true));
-	}
-//	ESP_ERROR_CHECK(i2c_master_write(h, buf, size, true));
-	ESP_ERROR_CHECK(i2c_master_stop(h));
-	esp_err_t r=i2c_master_cmd_begin(port, h, pdMS_TO_TICKS(10));
-	i2c_cmd_link_delete(h);
+	//Register address and data go out as one burst, rather than queueing a command
+	//link entry per byte.
+	uint8_t xfer[1+255];
+	xfer[0]=registerAdd;
+	memcpy(&xfer[1], buf, size);
+	int64_t t=esp_timer_get_time();
+	esp_err_t r=i2c_master_write_to_device(port, deviceAddr>>1, xfer, size+1, pdMS_TO_TICKS(10));
+	i2c_us+=esp_timer_get_time()-t;
+	i2c_xfers++;
 	if (r!=ESP_OK) ESP_LOGE(TAG, "fusb_wr: i2c returned error");
 	return (r==ESP_OK);
 }
@@ -60,19 +71,57 @@ static uint32_t pd_gettimestamp() { //in ms
 	return ts_ms;
 }
 
+//FUSB302 INT_N, active low
+#define FUSB_INT_GPIO ((gpio_num_t)3)
+//With nothing happening on the INT line, still run the policy engine this often so its
+//protocol timers (SinkWaitCap, SenderResponse, PSTransition, ...) can expire. Idle,
+//once negotiated, it has nothing time-critical left to do.
+#define PE_TIMER_MS_NEGOTIATING 10
+#define PE_TIMER_MS_IDLE 1000
+
+static TaskHandle_t usbpd_task_handle;
+
+static void IRAM_ATTR fusb_int_isr(void *arg) {
+	BaseType_t woken=pdFALSE;
+	vTaskNotifyGiveFromISR(usbpd_task_handle, &woken);
+	if (woken) portYIELD_FROM_ISR();
+}
+
 static void usbpd_task(void *arg) {
 	ESP_LOGI(TAG, "task running");
+	usbpd_task_handle=xTaskGetCurrentTaskHandle();
 	gpio_config_t cfg={};
-	cfg.pin_bit_mask=(1<<3);
+	cfg.pin_bit_mask=(1ULL<<FUSB_INT_GPIO);
 	cfg.mode=GPIO_MODE_INPUT;
+	cfg.intr_type=GPIO_INTR_NEGEDGE;
 	gpio_config(&cfg);
+	esp_err_t r=gpio_install_isr_service(0);
+	if (r!=ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(r); //already installed is fine
+	ESP_ERROR_CHECK(gpio_isr_handler_add(FUSB_INT_GPIO, fusb_int_isr, NULL));
 
 	pe->IRQOccured();
+	bool negotiated=false;
 	while(1) {
 		while(pe->thread()) ;
-		while (gpio_get_level((gpio_num_t)3)) vTaskDelay(pdMS_TO_TICKS(2));
-//		printf("IRQ!\n");
-		pe->IRQOccured();
+		if (!negotiated && pe->pdHasNegotiated()) {
+			negotiated=true;
+			ESP_LOGI(TAG, "PD contract after %d ms; %d i2c transfers took %d ms", 
+					(int)((esp_timer_get_time()-init_time)/1000), (int)i2c_xfers, (int)(i2c_us/1000));
+		}
+		//INT is a level; if it's still asserted, a new event came in while we were busy
+		//and we won't see another edge for it.
+		if (gpio_get_level(FUSB_INT_GPIO)) {
+			int ms=pe->pdHasNegotiated()?PE_TIMER_MS_IDLE:PE_TIMER_MS_NEGOTIATING;
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+		}
+		if (renegotiate_pending) {
+			renegotiate_pending=0;
+			pe->renegotiate();
+		}
+		if (!gpio_get_level(FUSB_INT_GPIO)) {
+//			printf("IRQ!\n");
+			pe->IRQOccured();
+		}
 	}
 }
 
@@ -93,6 +142,7 @@ bool pdbs_dpm_evaluate_capability(const pd_msg *capabilities, pd_msg *request) {
 	int bestIndexVoltage = 0;
 	int bestIndexCurrent = 0;
 	bool bestIsPPS = false;
+	int ppsRange = 0, ppsLo = 0, ppsHi = 0;
 	int type=USBPD_ESP_CB_INITIAL;
 	for (uint8_t i = 0; i < numobj; i++) {
 		/* If we have a fixed PDO, its V equals our desired V, and its I is
@@ -107,10 +157,10 @@ bool pdbs_dpm_evaluate_capability(const pd_msg *capabilities, pd_msg *request) {
 					PD_PDO_SRC_FIXED_VOLTAGE_GET(capabilities->obj[i])); // voltage in mV units
 			int current_a_x100 = PD_PDO_SRC_FIXED_CURRENT_GET(
 					capabilities->obj[i]);            // current in 10mA units
-			printf("PD slot %d -> %d mV; %d mA\r\n", i, voltage_mv,
+			BLOG("PD slot %d -> %d mV; %d mA", i, voltage_mv,
 					current_a_x100 * 10);
 			int want=callback(type, voltage_mv, current_a_x100 * 10);
-			if (want) {
+			if (want && !bestIsPPS) {
 				// Proper voltage and valid, select this instead
 				bestIndex = i;
 				bestIndexVoltage = voltage_mv;
@@ -119,32 +169,44 @@ bool pdbs_dpm_evaluate_capability(const pd_msg *capabilities, pd_msg *request) {
 			}
 		} else if ((capabilities->obj[i] & PD_PDO_TYPE) == PD_PDO_TYPE_AUGMENTED
 				&& (capabilities->obj[i] & PD_APDO_TYPE) == PD_APDO_TYPE_PPS) {
-			// If this is a PPS slot, calculate the max voltage in the PPS range that
-			// can we be used and maintain
-			uint16_t max_voltage = PD_PAV2MV(
+			// If this is a PPS slot, see if its range overlaps with what we can use and if
+			// it can deliver enough current. If so, it wins over the fixed PDOs.
+			int max_voltage = PD_PAV2MV(
 					PD_APDO_PPS_MAX_VOLTAGE_GET(capabilities->obj[i]));
-			// uint16_t min_voltage =
-			// PD_PAV2MV(PD_APDO_PPS_MIN_VOLTAGE_GET(capabilities->obj[i]));
-			uint16_t max_current = PD_PAI2CA(
+			int min_voltage =
+					PD_PAV2MV(PD_APDO_PPS_MIN_VOLTAGE_GET(capabilities->obj[i]));
+			int max_current = PD_PAI2CA(
 					PD_APDO_PPS_CURRENT_GET(capabilities->obj[i])); // max current in 10mA units
-			printf("PD PDO slot %d -> %d mV; %d mA\r\n", i, max_voltage,
+			BLOG("PD PPS slot %d -> %d-%d mV; %d mA", i, min_voltage, max_voltage,
 					max_current * 10);
-			// Using the current and tip resistance, calculate the ideal max voltage
-			// if this is range, then we will work with this voltage
-			// if this is not in range; then max_voltage can be safely selected
-/*
-			if (max_voltage > bestIndexVoltage || bestIndex == 0xFF) {
+			int lo=(min_voltage>pps_sink_min_mv)?min_voltage:pps_sink_min_mv;
+			int hi=(max_voltage<pps_sink_max_mv)?max_voltage:pps_sink_max_mv;
+			if (pps_sink_max_mv && lo<=hi && max_current*10>=pps_sink_ma 
+					&& (!bestIsPPS || hi-lo>ppsRange)) {
 				bestIndex = i;
-				bestIndexVoltage = max_voltage;
 				bestIndexCurrent = max_current;
 				bestIsPPS = true;
+				ppsRange = hi-lo;
+				ppsLo = lo;
+				ppsHi = hi;
 			}
-*/
 		}
 	}
 
+	if (bestIsPPS) {
+		int mv=pps_req_mv;
+		if (mv<ppsLo) mv=ppsLo;
+		if (mv>ppsHi) mv=ppsHi;
+		mv=(mv/20)*20; //PPS voltage granularity
+		bestIndexVoltage = mv;
+		pps_min_mv=ppsLo;
+		pps_max_mv=ppsHi;
+		pps_req_mv=mv;
+	}
+	pps_active=bestIsPPS;
+
 	if (bestIndex != 0xFF) {
-		printf("Found desired capability at index  %d, %d mV, %d mA\r\n",
+		BLOG("Found desired capability at index %d, %d mV, %d mA",
 				(int) bestIndex, bestIndexVoltage, bestIndexCurrent * 10);
 
 		/* We got what we wanted, so build a request for that */
@@ -207,12 +269,17 @@ void pdbs_dpm_get_sink_capability(pd_msg *cap, const bool isPD3) {
 		if (PD_MV2PDV(voltage) != PD_MV2PDV(5000)) {
 			cap->obj[0] |= PD_PDO_SNK_FIXED_HIGHER_CAP;
 		}
-		/* If we're using PD 3.0, add a PPS APDO for our desired voltage */
+		/* If we're using PD 3.0, add a PPS APDO for our desired voltage range */
 		if (isPD3) {
+			int pps_min=voltage, pps_max=voltage;
+			if (pps_sink_max_mv) {
+				pps_min=pps_sink_min_mv;
+				pps_max=pps_sink_max_mv;
+			}
 			cap->obj[numobj++] =
 					PD_PDO_TYPE_AUGMENTED | PD_APDO_TYPE_PPS
 							| PD_APDO_PPS_MAX_VOLTAGE_SET(
-									PD_MV2PAV(voltage)) | PD_APDO_PPS_MIN_VOLTAGE_SET(PD_MV2PAV(voltage)) | PD_APDO_PPS_CURRENT_SET(PD_CA2PAI(current));
+									PD_MV2PAV(pps_max)) | PD_APDO_PPS_MIN_VOLTAGE_SET(PD_MV2PAV(pps_min)) | PD_APDO_PPS_CURRENT_SET(PD_CA2PAI(current));
 		}
 	}
 	/* Set the USB communications capable flag. */
@@ -230,10 +297,45 @@ bool pds_dpm_epr_evaluate_capability(const epr_pd_msg *capabilities, pd_msg *req
 	return false;
 }
 
+void usbpd_esp_set_pps_range(int min_mv, int max_mv, int start_mv, int ma) {
+	pps_sink_min_mv=min_mv;
+	pps_sink_max_mv=max_mv;
+	pps_sink_ma=ma;
+	pps_req_mv=start_mv;
+}
+
+int usbpd_esp_pps_get(int *mv, int *min_mv, int *max_mv) {
+	if (!pps_active) return 0;
+	*mv=pps_req_mv;
+	*min_mv=pps_min_mv;
+	*max_mv=pps_max_mv;
+	return 1;
+}
+
+esp_err_t usbpd_esp_pps_request(int mv) {
+	if (!pps_active) return ESP_ERR_INVALID_STATE;
+	if (mv<pps_min_mv) mv=pps_min_mv;
+	if (mv>pps_max_mv) mv=pps_max_mv;
+	if (mv==pps_req_mv) return ESP_OK;
+	pps_req_mv=mv;
+	//The policy engine isn't thread-safe; have the usbpd task kick off the new request.
+	renegotiate_pending=1;
+	xTaskNotifyGive(usbpd_task_handle);
+	return ESP_OK;
+}
+
 esp_err_t usbpd_esp_init(i2c_port_t i2c_port, usbpd_esp_cb_t cb) {
 	port=i2c_port;
 	callback=cb;
+	init_time=esp_timer_get_time();
+#if CONFIG_DEKA_STATIC_ALLOC
+	//Placement-new into static buffers, so the long-lived objects don't live on the heap.
+	alignas(FUSB302) static uint8_t fusb_buf[sizeof(FUSB302)];
+	alignas(PolicyEngine) static uint8_t pe_buf[sizeof(PolicyEngine)];
+	fusb=new(fusb_buf) FUSB302(FUSB302B_ADDR, fusb_rd, fusb_wr, fusb_delay);
+#else
 	fusb=new FUSB302(FUSB302B_ADDR, fusb_rd, fusb_wr, fusb_delay);
+#endif
 	if (!fusb->fusb_read_id()) {
 		ESP_LOGE(TAG, "fusb_read_id failed!");
 		goto err_fusb;
@@ -242,16 +344,29 @@ esp_err_t usbpd_esp_init(i2c_port_t i2c_port, usbpd_esp_cb_t cb) {
 		ESP_LOGE(TAG, "fusb_setup failed!");
 		goto err_fusb;
 	}
+#if CONFIG_DEKA_STATIC_ALLOC
+	pe=new(pe_buf) PolicyEngine(*fusb, pd_gettimestamp, fusb_delay, 
+			pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, 
+			pds_dpm_epr_evaluate_capability, 5);
+	static StackType_t task_stack[4096];
+	static StaticTask_t task_tcb;
+	xTaskCreateStatic(usbpd_task, "usbpd", 4096, NULL, 23, task_stack, &task_tcb);
+#else
 	pe=new PolicyEngine(*fusb, pd_gettimestamp, fusb_delay, 
 			pdbs_dpm_get_sink_capability, pdbs_dpm_evaluate_capability, 
 			pds_dpm_epr_evaluate_capability, 5);
 
 	xTaskCreate(usbpd_task, "usbpd", 4096, NULL, 23, NULL);
+#endif
 	return ESP_OK;
 //err_pe:
 	delete(pe);
 err_fusb:
+#if CONFIG_DEKA_STATIC_ALLOC
+	fusb->~FUSB302();
+#else
 	delete(fusb);
+#endif
 	return ESP_ERR_INVALID_RESPONSE;
 }
 
@@ -30,6 +30,28 @@ typedef int (*usbpd_esp_cb_t)(int type, int mv, int ma);
 */
 esp_err_t usbpd_esp_init(i2c_port_t i2c_port, usbpd_esp_cb_t cb);
 
+/*
+ Enable PPS (programmable power supply) support. Call before usbpd_esp_init. If the
+ supply has a PPS APDO that overlaps min_mv-max_mv and can deliver at least ma, that
+ is used instead of the fixed PDOs, starting at start_mv: the callback still gets to see
+ the fixed PDOs, but the USBPD_ESP_CB_CHOSEN call carries the PPS voltage. Without a
+ usable APDO, the fixed PDO the callback picked is used as before.
+*/
+void usbpd_esp_set_pps_range(int min_mv, int max_mv, int start_mv, int ma);
+
+/*
+ Returns 1 and the current PPS voltage plus the range it can be set to if a PPS
+ contract is in use, 0 if we're on a fixed PDO.
+*/
+int usbpd_esp_pps_get(int *mv, int *min_mv, int *max_mv);
+
+/*
+ Request a different PPS voltage. It is clamped to the usable range and rounded to
+ 20mV. The new request goes out in the background; the callback is called with
+ USBPD_ESP_CB_CHOSEN when it does.
+*/
+esp_err_t usbpd_esp_pps_request(int mv);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
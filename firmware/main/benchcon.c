@@ -0,0 +1,341 @@
+//Serial console with on-device microbenchmarks of the firmware hot paths.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_console.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "benchcon.h"
+#include "snmppdu.h"
+#include "dekatron.h"
+#include "webconfig.h"
+
+static const char *TAG="benchcon";
+
+/*
+Every benchmark runs in a fresh task, so the stack high water mark is its own. A bench
+function does one iteration and returns the cycles spent in the code under test, or
+BENCH_FAIL if the code under test returned the wrong result; a parser that bails out early
+would look very fast otherwise. If it allocates, it calls heap_peak() at the point where
+most is allocated, outside of the timed section as getting the heap info is slow.
+*/
+#define BENCH_STACK 6144
+#define BENCH_DEFAULT_ITER 100
+#define BENCH_FAIL UINT32_MAX
+
+typedef uint32_t (*bench_fn_t)();
+
+typedef struct {
+	const char *name;
+	const char *desc;
+	bench_fn_t fn;
+} bench_t;
+
+typedef struct {
+	const bench_t *bench;
+	int iter;
+	TaskHandle_t caller;
+	uint32_t min, max;
+	uint64_t sum;
+	int peak_blocks, peak_bytes;	//most heap allocated in an iteration
+	int leak_bytes;					//heap not given back after all iterations
+	int stack_bytes;
+	int failed;
+} bench_run_t;
+
+static multi_heap_info_t heap_base;
+static int peak_blocks, peak_bytes;
+
+static void heap_peak() {
+	multi_heap_info_t hi;
+	heap_caps_get_info(&hi, MALLOC_CAP_8BIT);
+	int blocks=hi.allocated_blocks-heap_base.allocated_blocks;
+	int bytes=hi.total_allocated_bytes-heap_base.total_allocated_bytes;
+	if (blocks>peak_blocks) peak_blocks=blocks;
+	if (bytes>peak_bytes) peak_bytes=bytes;
+}
+
+static uint32_t bench_nop() {
+	uint32_t start=esp_cpu_get_cycle_count();
+	return esp_cpu_get_cycle_count()-start;
+}
+
+//Same request snmpgetter generates, using the allocating encoder.
+static uint32_t bench_snmp_enc() {
+	static char pkt[128];
+	int oid[]={1,3,6,1,2,1,31,1,1,1,6,1,-1};
+	uint32_t start=esp_cpu_get_cycle_count();
+	PduField *req=pduNewSequence();
+	pduAddToSequence(req, pduNewInt(1));
+	pduAddToSequence(req, pduNewOctetString("public"));
+	PduField *getreq=pduNewGetReqPdu();
+	pduAddToSequence(getreq, pduNewInt(0x40000000));
+	pduAddToSequence(getreq, pduNewInt(0));
+	pduAddToSequence(getreq, pduNewInt(0));
+	PduField *vbl=pduNewSequence();
+	PduField *vb=pduNewSequence();
+	pduAddToSequence(vb, pduNewOid(oid));
+	pduAddToSequence(vb, pduNewNull());
+	pduAddToSequence(vbl, vb);
+	pduAddToSequence(getreq, vbl);
+	pduAddToSequence(req, getreq);
+	pduToBin(req, pkt);
+	uint32_t cycles=esp_cpu_get_cycle_count()-start;
+	heap_peak();
+	start=esp_cpu_get_cycle_count();
+	pduFree(req);
+	return cycles+esp_cpu_get_cycle_count()-start;
+}
+
+//GetResponse for ifHCInOctets.1 = 0x123456789A, as the router would send it.
+static const char snmp_resp[]={
+	0x30, 0x31, 0x02, 0x01, 0x01, 0x04, 0x06, 'p', 'u', 'b', 'l', 'i', 'c',
+	0xA2, 0x24, 0x02, 0x04, 0x40, 0x00, 0x00, 0x01, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00,
+	0x30, 0x16, 0x30, 0x14, 0x06, 0x0B, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x1F, 0x01, 0x01, 0x01, 0x06, 0x01,
+	0x46, 0x05, 0x12, 0x34, 0x56, 0x78, 0x9A
+};
+
+static uint32_t bench_snmp_dec() {
+	int reqid, errstat;
+	uint64_t val;
+	uint32_t start=esp_cpu_get_cycle_count();
+	int ok=pduParseIntResp(snmp_resp, sizeof(snmp_resp), &reqid, &errstat, &val);
+	uint32_t cycles=esp_cpu_get_cycle_count()-start;
+	if (!ok || reqid!=0x40000001 || val!=0x123456789AULL) return BENCH_FAIL;
+	return cycles;
+}
+
+//GetRequest for the same OID, through the parser the agent and trap receiver use.
+static const char snmp_get[]={
+	0x30, 0x2C, 0x02, 0x01, 0x01, 0x04, 0x06, 'p', 'u', 'b', 'l', 'i', 'c',
+	0xA0, 0x1F, 0x02, 0x04, 0x40, 0x00, 0x00, 0x01, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00,
+	0x30, 0x11, 0x30, 0x0F, 0x06, 0x0B, 0x2B, 0x06, 0x01, 0x02, 0x01, 0x1F, 0x01, 0x01, 0x01, 0x06, 0x01,
+	0x05, 0x00
+};
+
+static uint32_t bench_snmp_req() {
+	static PduReq req; //too large for the stack
+	uint32_t start=esp_cpu_get_cycle_count();
+	int ok=pduParseReq(snmp_get, sizeof(snmp_get), &req);
+	uint32_t cycles=esp_cpu_get_cycle_count()-start;
+	if (ok!=1 || req.pdu_type!=PRIM_GETREQPDU || req.nvb!=1 || req.oid[0][0]==-1) return BENCH_FAIL;
+	return cycles;
+}
+
+//A '1'-like cluster, so the planner takes the ping-pong path...
+static uint32_t bench_intens() {
+	uint8_t intens[30]={0};
+	for (int i=4; i<12; i++) intens[i]=255;
+	return deka_bench_plan(intens);
+}
+
+//...and something spread out, for the full sweep.
+static uint32_t bench_intens_sweep() {
+	uint8_t intens[30];
+	for (int i=0; i<30; i++) intens[i]=(i*37)&0xff;
+	return deka_bench_plan(intens);
+}
+
+static uint32_t bench_timer_step() {
+	return deka_bench_timer_step();
+}
+
+static uint32_t bench_getfields() {
+	uint32_t start=esp_cpu_get_cycle_count();
+	char *txt=webconfig_render_getfields();
+	uint32_t cycles=esp_cpu_get_cycle_count()-start;
+	heap_peak();
+	start=esp_cpu_get_cycle_count();
+	free(txt);
+	return cycles+esp_cpu_get_cycle_count()-start;
+}
+
+static uint32_t bench_nvs() {
+	char buf[64];
+	uint32_t start=esp_cpu_get_cycle_count();
+	webconfig_get_config_str("community", buf, sizeof(buf));
+	return esp_cpu_get_cycle_count()-start;
+}
+
+static const bench_t benches[]={
+	{"nop", "measurement overhead", bench_nop},
+	{"snmp_enc", "encode a GetRequest (allocating encoder)", bench_snmp_enc},
+	{"snmp_dec", "decode a GetResponse (pduParseIntResp)", bench_snmp_dec},
+	{"snmp_req", "parse a GetRequest (pduParseReq)", bench_snmp_req},
+	{"intens", "plan a clustered pattern", bench_intens},
+	{"intens_sweep", "plan a full-sweep pattern", bench_intens_sweep},
+	{"timer_step", "one cathode ISR step", bench_timer_step},
+	{"getfields", "render /getfields", bench_getfields},
+	{"nvs", "read one config string from NVS", bench_nvs},
+	{NULL, NULL, NULL}
+};
+
+static void bench_task(void *arg) {
+	bench_run_t *r=(bench_run_t*)arg;
+	r->min=UINT32_MAX;
+	r->max=0;
+	r->sum=0;
+	peak_blocks=0;
+	peak_bytes=0;
+	//Warm up caches and any lazy init, so it doesn't count as a leak
+	r->failed=(r->bench->fn()==BENCH_FAIL);
+	heap_caps_get_info(&heap_base, MALLOC_CAP_8BIT);
+	for (int i=0; i<r->iter && !r->failed; i++) {
+		uint32_t c=r->bench->fn();
+		if (c==BENCH_FAIL) {
+			r->failed=1;
+			break;
+		}
+		if (c<r->min) r->min=c;
+		if (c>r->max) r->max=c;
+		r->sum+=c;
+	}
+	multi_heap_info_t hi;
+	heap_caps_get_info(&hi, MALLOC_CAP_8BIT);
+	r->leak_bytes=hi.total_allocated_bytes-heap_base.total_allocated_bytes;
+	r->peak_blocks=peak_blocks;
+	r->peak_bytes=peak_bytes;
+	r->stack_bytes=BENCH_STACK-uxTaskGetStackHighWaterMark(NULL);
+	xTaskNotifyGive(r->caller);
+	vTaskDelete(NULL);
+}
+
+//Returns 0 if the bench failed.
+static int bench_run(const bench_t *b, int iter) {
+	bench_run_t r={.bench=b, .iter=iter, .caller=xTaskGetCurrentTaskHandle()};
+	//Same priority as the console; the numbers include whatever interrupts happen, which
+	//is why min is reported as well as the average.
+	if (xTaskCreate(bench_task, "bench", BENCH_STACK, &r, uxTaskPriorityGet(NULL), NULL)!=pdPASS) {
+		printf("%-12s: can't create task\n", b->name);
+		return 0;
+	}
+	ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	if (r.failed) {
+		printf("%-12s: FAILED, code under test returned the wrong result\n", b->name);
+		return 0;
+	}
+	printf("%-12s %8lu %8lu %8lu %6d %7d %6d %6d\n", b->name,
+			(unsigned long)r.min, (unsigned long)(r.sum/iter), (unsigned long)r.max,
+			r.peak_blocks, r.peak_bytes, r.leak_bytes, r.stack_bytes);
+	return 1;
+}
+
+static int bench_cmd(int argc, char **argv) {
+	if (argc<2) {
+		printf("Usage: bench all|<name> [iterations]\n");
+		for (int i=0; benches[i].name; i++) {
+			printf("  %-12s %s\n", benches[i].name, benches[i].desc);
+		}
+		return 0;
+	}
+	int iter=BENCH_DEFAULT_ITER;
+	if (argc>2) iter=atoi(argv[2]);
+	if (iter<1) iter=1;
+	int found=0, failed=0;
+	printf("%-12s %8s %8s %8s %6s %7s %6s %6s\n", "bench", "min_cyc", "avg_cyc", "max_cyc",
+			"allocs", "a_bytes", "leak", "stack");
+	for (int i=0; benches[i].name; i++) {
+		if (strcmp(argv[1], "all")==0 || strcmp(argv[1], benches[i].name)==0) {
+			if (!bench_run(&benches[i], iter)) failed=1;
+			found=1;
+		}
+	}
+	if (!found) {
+		printf("No such benchmark: %s\n", argv[1]);
+		return 1;
+	}
+	return failed;
+}
+
+/*
+NVS writes turn off the flash cache, and the cathode ISR has to keep going while that
+happens. 'nvsstress' animates the tube, writes and commits a blob to a scratch namespace
+over and over, then waits as long again without writing, and compares the cathode steps
+that came late (deka_get_isr_glitches) in both periods.
+*/
+#define NVSSTRESS_DEFAULT_WRITES 200
+#define NVSSTRESS_BLOB_SIZE 256
+
+static int nvsstress_cmd(int argc, char **argv) {
+	int writes=NVSSTRESS_DEFAULT_WRITES;
+	if (argc>1) writes=atoi(argv[1]);
+	if (writes<1) writes=1;
+	nvs_handle_t h;
+	esp_err_t err=nvs_open("nvsstress", NVS_READWRITE, &h);
+	if (err!=ESP_OK) {
+		printf("nvs_open: %s\n", esp_err_to_name(err));
+		return 1;
+	}
+	static uint8_t blob[NVSSTRESS_BLOB_SIZE];
+	//A multiplexed pattern keeps the ISR stepping every few hundred us. The normal display
+	//takes over again at the next sample after the flush at the end.
+	deka_flush_anims();
+	deka_queue_anim(DEKA_ANIM_TYPE_GOOGLE, 0, 10*1000, 3600*1000);
+	vTaskDelay(pdMS_TO_TICKS(100));
+
+	uint32_t g_start=deka_get_isr_glitches();
+	int64_t start=esp_timer_get_time();
+	for (int i=0; i<writes && err==ESP_OK; i++) {
+		memset(blob, i, sizeof(blob)); //different data every time, or NVS skips the write
+		err=nvs_set_blob(h, "blob", blob, sizeof(blob));
+		if (err==ESP_OK) err=nvs_commit(h);
+	}
+	int write_ms=(esp_timer_get_time()-start)/1000;
+	uint32_t g_write=deka_get_isr_glitches()-g_start;
+	nvs_erase_all(h);
+	nvs_commit(h);
+	nvs_close(h);
+	if (err!=ESP_OK) printf("NVS write failed: %s\n", esp_err_to_name(err));
+
+	g_start=deka_get_isr_glitches();
+	vTaskDelay(pdMS_TO_TICKS(write_ms)+1);
+	uint32_t g_idle=deka_get_isr_glitches()-g_start;
+	deka_flush_anims();
+
+	printf("%d writes in %d ms: %lu late cathode steps, %lu while idle for as long: %s\n",
+			writes, write_ms, (unsigned long)g_write, (unsigned long)g_idle,
+			(g_write>g_idle)?"FAIL":"OK");
+	return (err!=ESP_OK || g_write>g_idle);
+}
+
+void benchcon_start() {
+	esp_console_repl_t *repl=NULL;
+	esp_console_repl_config_t repl_config=ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+	repl_config.prompt="deka>";
+	esp_console_dev_usb_serial_jtag_config_t hw_config=ESP_CONSOLE_DEV_USB_SERIAL_JTAG_CONFIG_DEFAULT();
+	ESP_ERROR_CHECK(esp_console_new_repl_usb_serial_jtag(&hw_config, &repl_config, &repl));
+
+	const esp_console_cmd_t cmd={
+		.command="bench",
+		.help="Run on-device microbenchmarks; reports CPU cycles per call, heap blocks/bytes "
+				"allocated at peak, heap not freed and stack used",
+		.hint="all|<name> [iterations]",
+		.func=&bench_cmd,
+	};
+	ESP_ERROR_CHECK(esp_console_cmd_register(&cmd));
+	const esp_console_cmd_t nvs_cmd={
+		.command="nvsstress",
+		.help="Hammer NVS with writes while the tube animates, and count the cathode steps "
+				"that got delayed by it",
+		.hint="[writes]",
+		.func=&nvsstress_cmd,
+	};
+	ESP_ERROR_CHECK(esp_console_cmd_register(&nvs_cmd));
+	esp_console_register_help_command();
+	ESP_ERROR_CHECK(esp_console_start_repl(repl));
+	ESP_LOGI(TAG, "Console started");
+}
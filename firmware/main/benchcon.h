@@ -0,0 +1,6 @@
+#pragma once
+
+//Start a console REPL on the USB-serial-JTAG port, with a 'bench' command that runs
+//microbenchmarks of the firmware hot paths and an 'nvsstress' command that checks the
+//display keeps running during NVS writes. Needs webconfig to be started.
+void benchcon_start();
@@ -0,0 +1,213 @@
+// Counter update period detection and phase-locked poll scheduling.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ctrlock.h"
+
+/*
+How it works: every sample in which the counters moved brackets an agent update between
+the previous sample and this one. While polling at a fixed cadence, the intervals between
+those samples give the update period, if there were unchanged samples in between (if not,
+the counters update at least as fast as we poll and there's nothing to lock to). After
+that, brackets from different periods are shifted onto each other and intersected. We
+poll twice per period: once in the middle of the bracket, which halves it whatever the
+result is, and once just after its end, which is the sample that has the fresh counter
+values. When the bracket gets as narrow as the timing noise, the first poll moves to just
+before the bracket instead, to notice drift. Both keep a margin for request latency plus
+what the error in the period adds up to. The narrow brackets many periods apart pin down
+the period a lot better than the initial estimate.
+*/
+#define CTRLOCK_PERIOD_MIN_US 1000000	//faster than this isn't worth locking to
+#define CTRLOCK_PERIOD_MAX_US 12000000	//slower than this is probably just idle traffic
+#define CTRLOCK_GUARD_US 30000			//margin around the bracket for request latency
+#define CTRLOCK_MAX_MISSES 3			//inconsistent updates in a row before we relearn
+
+static int cmp_i64(const void *a, const void *b) {
+	int64_t x=*(const int64_t*)a, y=*(const int64_t*)b;
+	return (x>y)-(x<y);
+}
+
+static int64_t div_round(int64_t a, int64_t b) {
+	return (a>=0)?(a+b/2)/b:-((-a+b/2)/b);
+}
+
+//Forget everything about the period and go back to polling at a fixed cadence.
+static void relearn(ctrlock_t *cl) {
+	cl->have_change=0;
+	cl->niv=0;
+	cl->max_gap=0;
+	cl->period_us=0;
+	cl->have_bracket=0;
+	cl->misses=0;
+	cl->live=0;
+	cl->skips=0;
+}
+
+static void learn_period(ctrlock_t *cl) {
+	int n=(cl->niv<CTRLOCK_HIST)?cl->niv:CTRLOCK_HIST;
+	if (n<CTRLOCK_HIST/2) return;
+	int zeros=0;
+	for (int i=0; i<n; i++) zeros+=cl->iv_zeros[i];
+	if (zeros*2<n) return;
+	//Intervals in which traffic stopped for a while are multiples of the period. Use the
+	//median to tell how many periods each interval is, then divide the total time by the
+	//total amount of periods; that way, the poll timing mostly cancels out.
+	int64_t s[CTRLOCK_HIST];
+	memcpy(s, cl->iv, n*sizeof(int64_t));
+	qsort(s, n, sizeof(int64_t), cmp_i64);
+	int64_t med=s[n/2];
+	if (med<=0) return;
+	int64_t sum=0, periods=0;
+	for (int i=0; i<n; i++) {
+		int64_t k=div_round(s[i], med);
+		if (k<1) k=1;
+		sum+=s[i];
+		periods+=k;
+	}
+	int64_t p=sum/periods;
+	if (p<CTRLOCK_PERIOD_MIN_US || p>CTRLOCK_PERIOD_MAX_US) return;
+	cl->period_us=p;
+	cl->period_err_us=cl->max_gap/periods;
+	cl->anchor_w=0;
+}
+
+//The update in (a, b] is a whole amount of periods after the anchor, the first narrow
+//bracket we got. Returns 0 if it can't be, given what we know about the period, 1 if it
+//fits, -1 if (a, b] is too wide to tell. The further apart they are, the better the period
+//we get from them.
+static int refine_period(ctrlock_t *cl, int64_t a, int64_t b) {
+	int64_t mid=a+(b-a)/2;
+	int64_t w=b-a;
+	int ok=-1;
+	if (cl->anchor_w && w<cl->period_us/2) {
+		int64_t d=mid-cl->anchor_mid;
+		int64_t k=div_round(d, cl->period_us);
+		int64_t err=(w+cl->anchor_w)/2;
+		if (k>=1) {
+			ok=(llabs(d-k*cl->period_us)<=err+k*cl->period_err_us+CTRLOCK_GUARD_US);
+			if (ok && err/k<cl->period_err_us) {
+				cl->period_us=d/k;
+				cl->period_err_us=err/k;
+			}
+		}
+	}
+	if (!cl->anchor_w && w<cl->period_us/4) {
+		cl->anchor_mid=mid;
+		cl->anchor_w=w;
+	}
+	return ok;
+}
+
+//An update happened in (a, b]. Intersect with what we already know. Returns 0 if that
+//doesn't overlap at all.
+static int update_bracket(ctrlock_t *cl, int64_t a, int64_t b) {
+	if (cl->have_bracket) {
+		//Shift the old bracket by a whole amount of periods to line up with the new one,
+		//widening it by how far off the period can be.
+		int64_t k=div_round((a+b)/2-(cl->lo+cl->hi)/2, cl->period_us);
+		int64_t lo=cl->lo+k*cl->period_us-llabs(k)*cl->period_err_us;
+		int64_t hi=cl->hi+k*cl->period_us+llabs(k)*cl->period_err_us;
+		if (a>lo) lo=a;
+		if (b<hi) hi=b;
+		if (lo<hi) {
+			cl->lo=lo;
+			cl->hi=hi;
+			return 1;
+		}
+		//No overlap: the phase drifted or the period is off. Start over.
+		cl->lo=a;
+		cl->hi=b;
+		return 0;
+	}
+	cl->lo=a;
+	cl->hi=b;
+	cl->have_bracket=1;
+	return 1;
+}
+
+int ctrlock_sample(ctrlock_t *cl, int64_t ts_us, int64_t in_bytes, int64_t out_bytes) {
+	int use=1;
+	if (!cl->have_last) {
+		cl->have_last=1;
+	} else if (in_bytes!=cl->last_in || out_bytes!=cl->last_out) {
+		if (!cl->period_us) {
+			if (ts_us-cl->last_ts>cl->max_gap) cl->max_gap=ts_us-cl->last_ts;
+			if (cl->have_change) {
+				cl->iv[cl->niv%CTRLOCK_HIST]=ts_us-cl->last_change_ts;
+				cl->iv_zeros[cl->niv%CTRLOCK_HIST]=(cl->zeros_since_change>0);
+				cl->niv++;
+				learn_period(cl);
+			}
+		} else {
+			//Counters that move in back-to-back samples don't have a period (anymore); if
+			//updates keep coming in later than the period, or at the wrong time, the period
+			//is wrong. Either way, start over.
+			cl->live=(cl->zeros_since_change==0)?cl->live+1:0;
+			cl->skips=(ts_us-cl->last_change_ts>cl->period_us+cl->period_us/2)?cl->skips+1:0;
+			int fit=refine_period(cl, cl->last_ts, ts_us);
+			if (!update_bracket(cl, cl->last_ts, ts_us) || fit==0) {
+				cl->misses++;
+			} else if (fit==1 && ts_us-cl->last_ts<=2*CTRLOCK_LOCK_WINDOW_US) {
+				cl->misses=0;
+			}
+		}
+		cl->have_change=1;
+		cl->zeros_since_change=0;
+		cl->last_change_ts=ts_us;
+		if (cl->live>=CTRLOCK_MAX_MISSES || cl->skips>=CTRLOCK_MAX_MISSES || cl->misses>=CTRLOCK_MAX_MISSES) {
+			relearn(cl);
+		}
+	} else {
+		if (!cl->period_us && ts_us-cl->last_ts>cl->max_gap) cl->max_gap=ts_us-cl->last_ts;
+		cl->zeros_since_change++;
+		//Only aliased if we expect an update to come; after a while without one, the
+		//link is simply idle and the zero rate is real. One missing update is allowed for,
+		//as using a zero sample followed by a late update would give a spike.
+		if (cl->period_us && ts_us-cl->last_change_ts<2*cl->period_us+cl->period_us/2) use=0;
+	}
+	cl->last_ts=ts_us;
+	cl->last_in=in_bytes;
+	cl->last_out=out_bytes;
+	return use;
+}
+
+int64_t ctrlock_next_poll(ctrlock_t *cl, int64_t now_us, int64_t interval_us) {
+	if (!cl->period_us || !cl->have_bracket) {
+		if (cl->next_fixed==0) cl->next_fixed=now_us;
+		cl->next_fixed+=interval_us;
+		//If we fell behind by more than an interval, don't try to catch up.
+		if (cl->next_fixed<now_us) cl->next_fixed=now_us+interval_us;
+		return cl->next_fixed;
+	}
+	cl->next_fixed=0;
+	int64_t p=cl->period_us;
+	//Find the first expected update we can still poll just after. The further ahead, the
+	//more the error in the period adds up.
+	int64_t k=0;
+	if (now_us>cl->hi+p) k=(now_us-cl->hi)/p;
+	int64_t margin, lo, hi;
+	while (1) {
+		margin=CTRLOCK_GUARD_US+k*cl->period_err_us;
+		lo=cl->lo+k*p-margin;
+		hi=cl->hi+k*p+margin;
+		if (hi>now_us) break;
+		k++;
+	}
+	int64_t width=hi-lo;
+	int64_t probe=(width>4*margin)?lo+width/2:lo;
+	if (probe>now_us) return probe;
+	return hi;
+}
+
+int ctrlock_locked(const ctrlock_t *cl, int64_t *period_us, int64_t *window_us) {
+	*period_us=cl->period_us;
+	*window_us=(cl->period_us && cl->have_bracket)?cl->hi-cl->lo:0;
+	return (*period_us && cl->have_bracket && *window_us<=CTRLOCK_LOCK_WINDOW_US);
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Counter update period detection. A lot of agents only refresh their interface counters
+every few seconds internally; polling faster than that gives runs of zero deltas followed
+by a spike. This learns the period and phase of those internal updates from the samples,
+tells which samples are aliased (carry no new information, so they shouldn't go into the
+rate calculation), and schedules polls just around the next expected update.
+
+Like ratecalc, this is free of ESP-IDF dependencies so the host tools can replay a trace
+through it.
+*/
+
+#define CTRLOCK_HIST 16
+#define CTRLOCK_LOCK_WINDOW_US 100000
+
+typedef struct {
+	int have_last, have_change;
+	int64_t last_ts;
+	int64_t last_in, last_out;
+	int64_t last_change_ts;			//last sample in which the counters moved
+	int zeros_since_change;			//unchanged samples since then
+	int64_t max_gap;				//longest time between samples while learning
+	int64_t iv[CTRLOCK_HIST];		//intervals between samples in which the counters moved...
+	uint8_t iv_zeros[CTRLOCK_HIST];	//...and if there were unchanged samples in between
+	int niv;
+	int64_t period_us;				//update period, 0 if not known (yet)
+	int64_t period_err_us;			//how far off period_us can be
+	int64_t anchor_mid, anchor_w;	//first narrow single-sample bracket, to refine the period
+	int have_bracket;
+	int64_t lo, hi;					//an update happened somewhere in (lo, hi]
+	int misses;						//updates in a row that didn't line up with the anchor
+	int live;						//changes in back-to-back samples in a row
+	int skips;						//updates in a row that came a period or more late
+	int64_t next_fixed;				//next poll when we're not locked to anything
+} ctrlock_t;
+
+//Feed the sample taken at ts_us. Returns 1 if it should be used to calculate a rate, 0 if
+//it's aliased: the counters didn't move, but only because the agent didn't update them yet.
+int ctrlock_sample(ctrlock_t *cl, int64_t ts_us, int64_t in_bytes, int64_t out_bytes);
+
+//Returns the time the next poll should happen. If no update period is known, this is a
+//fixed cadence of interval_us; otherwise one poll to narrow down the phase of the updates
+//and one just after the expected update. Deadlines are absolute, so they don't drift.
+int64_t ctrlock_next_poll(ctrlock_t *cl, int64_t now_us, int64_t interval_us);
+
+//Returns 1 if polls are locked to the agent updates, i.e. the update time is known to
+//within CTRLOCK_LOCK_WINDOW_US. Period and window are in us, 0 if unknown.
+int ctrlock_locked(const ctrlock_t *cl, int64_t *period_us, int64_t *window_us);
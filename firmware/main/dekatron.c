@@ -14,7 +14,7 @@
 #include "driver/ledc.h"
 #include "esp_err.h"
 #include "esp_log.h"
-#include "esp_adc/adc_oneshot.h"
+#include "esp_adc/adc_continuous.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 #include "freertos/FreeRTOS.h"
@@ -26,11 +26,36 @@
 #include <math.h>
 #include <string.h>
 #include "esp_timer.h"
+#include "esp_pm.h"
+#include "esp_cpu.h"
 #include "driver/gpio.h"
 #include "io.h"
+#include "membudget.h"
+#include "samplelog.h"
+#include "rtostrace.h"
+#include "fastboot.h"
+#if CONFIG_DEKA_DEDIC_GPIO
+#include "driver/dedic_gpio.h"
+#include "hal/dedic_gpio_cpu_ll.h"
+#endif
 
 static const char *TAG="dekatron";
 
+/*
+The cathode ISR has to keep running while the flash cache is off, e.g. during every NVS
+write, or the glow stalls on one cathode for as long as the write takes. That needs the
+gptimer interrupt to be IRAM-safe, and everything it calls to be in IRAM: the gptimer
+control functions and, without dedicated GPIO, gpio_set_level. Data it touches is
+DRAM_ATTR or plain (non-const) statics, which always live in DRAM.
+*/
+#if !CONFIG_GPTIMER_ISR_IRAM_SAFE || !CONFIG_GPTIMER_CTRL_FUNC_IN_IRAM
+#error "The cathode ISR needs CONFIG_GPTIMER_ISR_IRAM_SAFE and CONFIG_GPTIMER_CTRL_FUNC_IN_IRAM"
+#endif
+#if !CONFIG_DEKA_DEDIC_GPIO && !CONFIG_GPIO_CTRL_FUNC_IN_IRAM
+#error "The cathode ISR needs CONFIG_GPIO_CTRL_FUNC_IN_IRAM when not using dedicated GPIO"
+#endif
+#define ISR_GLITCH_US 50	//alarm serviced this late counts as a visible glitch
+
 
 /*
 For Fancy Animations (tm):
@@ -47,20 +72,105 @@ flexible, however, given we may want less max cathodes fully lit for a better br
 #define PULSE_MIN_US 83
 #define PULSE_MAX_US 666
 
-#define TIME_ONE_FRAME_US (1000000/60)
+/*
+The cathode timer runs at 10MHz. On top of that, the on-time of each cathode is kept in 24.8
+fixed point ticks, and a per-cathode sigma-delta accumulator decides whether a given frame
+gets the rounded-down or rounded-up amount of ticks. Averaged over a few frames, every cathode
+gets exactly its share, so we keep the full 8-bit intensity depth even at high refresh rates.
+Note that a higher refresh rate costs contrast: the 30 minimum pulses are a bigger part of
+the frame.
+*/
+#define TIMER_HZ 10000000
+#define TICKS_PER_US (TIMER_HZ/1000000)
+#define TIME_ONE_FRAME_US (1000000/CONFIG_DEKA_REFRESH_HZ)
 
 #define NO_FIXED_TARGET -1
+#define DUAL_TARGET -2
 static int curr_cathode=0;
 static int fixed_target=1;
-static int delay_per_cathode_us[30]={0};
-static char g1_for[30];
-static char g2_for[30];
+
+/*
+Dual glow mode. Stepping a single fixed_target from the animation task would need a task
+wakeup for every step of either glow, so here the ISR moves the glows itself: every call,
+it adds the time since the previous step to a phase accumulator per glow, and steps that
+glow once a full cathode time has accumulated. It then walks the tube to one glow, dwells
+there, walks to the other and dwells there. The dwell is sized so a full frame (both
+dwells plus both walks) takes TIME_ONE_FRAME_US, so the glows refresh at
+CONFIG_DEKA_REFRESH_HZ regardless of how far apart they are.
+*/
+#define DUAL_TICK_US 100000		//anim task only has to look for the next animation
+static uint32_t dual_step[2];	//ticks per cathode; glow 0 goes clockwise, glow 1 ccw
+static uint32_t dual_phase[2];	//ticks accumulated towards the next step
+static int dual_pos[2];
+static int dual_idx;			//glow we're walking to or dwelling on
+_Static_assert(2*15*PULSE_MIN_US<TIME_ONE_FRAME_US, "refresh rate too high for two glows");
+
+//A frame is described as a plan: a list of cathodes to step to, in order, and how long
+//to dwell on each. A full sweep is 30 forward steps; a sparse pattern can instead
+//oscillate inside the arc that covers all lit cathodes.
+typedef struct {
+	uint32_t delay_fp;	//in timer ticks, 24.8 fixed point
+	uint8_t cathode;
+	uint8_t dither_acc;
+} plan_step_t;
+
+typedef struct {
+	int len;
+	plan_step_t step[30];
+	uint32_t visit_fp[30];	//dwell per visit for each cathode, for the linearity stats
+} plan_t;
+
+//ISR walks active_plan; deka_set_intens fills next_plan and the ISR swaps them at the
+//start of a frame.
+static DRAM_ATTR plan_t plans[2];
+static plan_t *active_plan=&plans[0];
+static plan_t *next_plan=&plans[1];
+static int plan_idx=0;
+static int plan_pending=0;
+static portMUX_TYPE plan_mux=portMUX_INITIALIZER_UNLOCKED;
+//Refresh and linearity measurement
+static uint32_t frames;
+static uint32_t cathode_visits[30];
+static uint64_t cathode_ticks[30];
+//Guide outputs for each cathode. Bit 0 is G1, bit 1 is G2.
+#define GUIDE_G1 (1<<0)
+#define GUIDE_G2 (1<<1)
+static DRAM_ATTR uint8_t guide_pat[30];
+#if CONFIG_DEKA_DEDIC_GPIO
+static dedic_gpio_bundle_handle_t guide_bundle;
+static uint32_t guide_out_off; //first dedicated GPIO channel of the bundle
+#endif
 static int rotation=0;
-static int posdet_hit[30]={0};
 static int posdet_hit_total=0;
-static int posdet_prev=0;
 static int curr_pwm=0;
 atomic_int rot_corr=0;
+static gptimer_handle_t gptimer;
+
+/*
+Position detection. POSDET goes low when the glow passes the detector. Instead of sampling it
+every step, we take an edge interrupt, timestamp it against the cathode gptimer and match it
+against the cathode that was being driven at that time. The tracker in the power task then
+keeps a decaying histogram of (configured rotation - detected cathode) and corrects the cathode
+numbering when one offset clearly dominates.
+*/
+#define POSDET_SETTLE_US 20			//edge within this time of a step is still the previous cathode
+#define POSDET_DECAY_MS 250			//histogram decays by 1/8th every this many ms
+#define POSDET_MIN_WEIGHT (8<<8)	//min amount of (decayed) hits before we correct
+#define POSDET_CONF_PCT 60			//winning offset needs this percentage of all hits
+
+typedef struct {
+	uint8_t cathode;
+} posdet_ev_t;
+
+static QueueHandle_t posdet_queue;
+static uint64_t step_start;			//gptimer count at which curr_cathode started being driven
+static int prev_cathode=0;
+
+//Cathode ISR time accounting
+static uint32_t isr_calls, isr_max_cycles;
+static uint64_t isr_ticks;			//time spent in the ISR, in timer ticks
+static uint32_t isr_max_late, isr_glitches;	//alarm latency in timer ticks
+static int posdet_hist[30];			//weight per offset, 8-bit fixed point
 
 typedef struct {
 	char c;
@@ -83,70 +193,294 @@ static const font_ent_t font[]={
 	{0, 0}, //default
 };
 
+//user_data for a timer_cb call from deka_bench_timer_step()
+#define TIMER_CB_BENCH ((void*)1)
+
 static bool IRAM_ATTR timer_cb(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_data) {
+	//A bench call runs the stepping logic only. It leaves everything that outlives the
+	//step alone: the ISR statistics, the trace, the plan swap and the dither state.
+	bool bench=(user_data==TIMER_CB_BENCH);
+	uint32_t start_cycles=esp_cpu_get_cycle_count();
+	if (!bench) {
+		RTOSTRACE_ISR_ENTER(RTOSTRACE_ISR_CATHODE);
+	}
 	int delay;
-	if (!gpio_get_level(IO_POSDET)) {
-		if (!posdet_prev) {
-			posdet_hit[curr_cathode]++;
-			posdet_hit_total++;
-		}
-		posdet_prev=1;
-	} else {
-		posdet_prev=0;
+	uint32_t dt=edata->alarm_value-step_start;
+	//A stalled ISR, e.g. one that had to wait for the flash cache, shows up as a late alarm.
+	uint32_t late=edata->count_value-edata->alarm_value;
+	if (!bench && late>isr_max_late) isr_max_late=late;
+	if (!bench && late>ISR_GLITCH_US*TICKS_PER_US) {
+		isr_glitches++;
+		RTOSTRACE_TRIGGER();
 	}
-	curr_cathode+=atomic_exchange(&rot_corr, 0);
+	prev_cathode=curr_cathode;
+	step_start=edata->alarm_value;
+	//Nothing can change rot_corr while we're in here, so this doesn't need an atomic
+	//exchange, which on the C3 is a library call that may not be in IRAM.
+	curr_cathode+=atomic_load(&rot_corr);
+	atomic_store(&rot_corr, 0);
+	if (curr_cathode>=30) curr_cathode-=30;
+	if (curr_cathode<0) curr_cathode+=30;
 	if (fixed_target==NO_FIXED_TARGET) {
-		//Simply walk through the electrodes, lighting them up for the specified time
-		curr_cathode++;
-		if (curr_cathode>=30) curr_cathode=0;
-		delay=delay_per_cathode_us[curr_cathode];
+		if (!bench && plan_pending && plan_idx==0) {
+			plan_t *t=active_plan;
+			active_plan=next_plan;
+			next_plan=t;
+			plan_pending=0;
+		}
+		plan_step_t *st=&active_plan->step[plan_idx];
+		//Plan steps are adjacent, so normally this is one step. After a rotation
+		//correction or a plan change, we may need a few minimum pulses to get back.
+		int pulses_fwd=(st->cathode-curr_cathode);
+		if (pulses_fwd<0) pulses_fwd+=30;
+		if (pulses_fwd==0) {
+			//single-cathode plan; just stay put
+		} else if (pulses_fwd<15) {
+			curr_cathode++;
+			if (curr_cathode>=30) curr_cathode=0;
+		} else {
+			curr_cathode--;
+			if (curr_cathode<0) curr_cathode=29;
+		}
+		if (curr_cathode==st->cathode) {
+			//Sigma-delta: carry the fractional tick over to the next frame.
+			uint32_t acc=st->dither_acc+(st->delay_fp&0xff);
+			delay=(st->delay_fp>>8)+(acc>>8);
+			if (!bench) {
+				st->dither_acc=acc;
+				cathode_visits[curr_cathode]++;
+				cathode_ticks[curr_cathode]+=delay;
+			}
+			plan_idx++;
+			if (plan_idx>=active_plan->len) {
+				plan_idx=0;
+				frames++;
+			}
+		} else {
+			delay=PULSE_MIN_US*TICKS_PER_US;
+		}
+	} else if (fixed_target==DUAL_TARGET) {
+		//Never more than a frame between steps, but a bench call may pass anything.
+		if (dt>TIME_ONE_FRAME_US*TICKS_PER_US) dt=TIME_ONE_FRAME_US*TICKS_PER_US;
+		for (int g=0; g<2; g++) {
+			dual_phase[g]+=dt;
+			while (dual_phase[g]>=dual_step[g]) {
+				dual_phase[g]-=dual_step[g];
+				dual_pos[g]+=(g==0)?1:-1;
+			}
+			if (dual_pos[g]>=30) dual_pos[g]-=30;
+			if (dual_pos[g]<0) dual_pos[g]+=30;
+		}
+		int pulses_fwd=(dual_pos[dual_idx]-curr_cathode);
+		if (pulses_fwd<0) pulses_fwd+=30;
+		if (pulses_fwd==0) {
+			int dist=dual_pos[1]-dual_pos[0];
+			if (dist<0) dist=-dist;
+			if (dist>15) dist=30-dist;
+			delay=(TIME_ONE_FRAME_US-2*dist*PULSE_MIN_US)*TICKS_PER_US/2;
+			dual_idx^=1;
+			if (dual_idx==0) frames++;
+		} else if (pulses_fwd<15) {
+			curr_cathode++;
+			if (curr_cathode>=30) curr_cathode=0;
+			delay=PULSE_MIN_US*TICKS_PER_US;
+		} else {
+			curr_cathode--;
+			if (curr_cathode<0) curr_cathode=29;
+			delay=PULSE_MIN_US*TICKS_PER_US;
+		}
 	} else {
 		//Count towards the fixed target
 		int pulses_fwd=(fixed_target-curr_cathode);
 		if (pulses_fwd<0) pulses_fwd+=30;
 		if (pulses_fwd==0) {
-			delay=PULSE_MAX_US;
+			delay=PULSE_MAX_US*TICKS_PER_US;
 		} else if (pulses_fwd<15) {
 			curr_cathode++;
 			if (curr_cathode>=30) curr_cathode=0;
-			delay=PULSE_MIN_US;
+			delay=PULSE_MIN_US*TICKS_PER_US;
 		} else {
 			curr_cathode--;
 			if (curr_cathode<0) curr_cathode=29;
-			delay=PULSE_MIN_US;
+			delay=PULSE_MIN_US*TICKS_PER_US;
 		}
 	}
-	gpio_set_level(IO_G2, g2_for[curr_cathode]);
-	gpio_set_level(IO_G1, g1_for[curr_cathode]);
+#if CONFIG_DEKA_DEDIC_GPIO
+	//Both guides in one CSR write, so there's no in-between state. Note this writes all
+	//dedicated GPIO channels; we're the only user of those.
+	dedic_gpio_cpu_ll_write_all(guide_pat[curr_cathode]<<guide_out_off);
+#else
+	gpio_set_level(IO_G2, (guide_pat[curr_cathode]&GUIDE_G2)?1:0);
+	gpio_set_level(IO_G1, (guide_pat[curr_cathode]&GUIDE_G1)?1:0);
+#endif
 
 	// reconfigure alarm value
 	gptimer_alarm_config_t alarm_config = {
 		.alarm_count = edata->alarm_value + delay
 	};
+	if (bench) return true;
 	gptimer_set_alarm_action(timer, &alarm_config);
+
+	uint32_t cycles=esp_cpu_get_cycle_count()-start_cycles;
+	//The driver latched count_value on ISR entry. The timer runs at a fixed rate, so
+	//unlike cycles this stays valid when DFS changes the CPU clock.
+	uint64_t now;
+	gptimer_get_raw_count(timer, &now);
+	isr_calls++;
+	isr_ticks+=now-edata->count_value;
+	if (cycles>isr_max_cycles) isr_max_cycles=cycles;
+	RTOSTRACE_ISR_EXIT(RTOSTRACE_ISR_CATHODE);
 	return true;
 }
 
+static void IRAM_ATTR posdet_isr(void *arg) {
+	uint64_t now;
+	gptimer_get_raw_count(gptimer, &now);
+	posdet_ev_t ev;
+	uint64_t since=now-step_start;
+	//The glow takes a little while to transfer, so an edge right after a step is
+	//likely still caused by the cathode we just left.
+	ev.cathode=(since<POSDET_SETTLE_US*TICKS_PER_US)?prev_cathode:curr_cathode;
+	posdet_hit_total++;
+	BaseType_t hi_prio_awoken=pdFALSE;
+	xQueueSendFromISR(posdet_queue, &ev, &hi_prio_awoken);
+	if (hi_prio_awoken) portYIELD_FROM_ISR();
+}
+
+//Called periodically from the power task. Feeds the posdet events into the histogram and
+//corrects the rotation if we're confident about the offset.
+static void posdet_track(int decay) {
+	posdet_ev_t ev;
+	while (xQueueReceive(posdet_queue, &ev, 0)) {
+		int off=rotation-ev.cathode;
+		if (off<0) off+=30;
+		posdet_hist[off]+=(1<<8);
+	}
+	if (!decay) return;
+
+	int total=0, best=0;
+	for (int i=0; i<30; i++) {
+		posdet_hist[i]-=posdet_hist[i]/8;
+		total+=posdet_hist[i];
+		if (posdet_hist[i]>posdet_hist[best]) best=i;
+	}
+	if (best==0 || posdet_hist[best]<POSDET_MIN_WEIGHT) return;
+	if (posdet_hist[best]*100<total*POSDET_CONF_PCT) return;
+	//Apply the shortest correction, then shift the histogram so it's in the corrected
+	//numbering as well; the hits it contains are still valid evidence.
+	int c=(best>15)?best-30:best;
+	atomic_fetch_add(&rot_corr, c);
+	int tmp[30];
+	for (int i=0; i<30; i++) tmp[i]=posdet_hist[(i+best)%30];
+	memcpy(posdet_hist, tmp, sizeof(tmp));
+	ESP_LOGD(TAG, "posdet: corrected rotation by %d", c);
+}
+
 static void deka_set_pos(int pos) {
 	pos=pos%30;
 	if (pos<0) pos+=30;
 	fixed_target=pos;
 }
 
-static void deka_set_intens(uint8_t *intens) {
-	//This tries to set the timings so one 'frame' (decatron making a full circle) takes
-	//up TIME_ONE_FRAME_US time. It does that by trying to maximise the time the 
-	//non-zero-intensity cathodes are lit.
+static void deka_set_dual(int delay_cw_us, int delay_ccw_us) {
+	if (delay_cw_us<PULSE_MIN_US) delay_cw_us=PULSE_MIN_US;
+	if (delay_ccw_us<PULSE_MIN_US) delay_ccw_us=PULSE_MIN_US;
+	portENTER_CRITICAL(&plan_mux);
+	dual_step[0]=delay_cw_us*TICKS_PER_US;
+	dual_step[1]=delay_ccw_us*TICKS_PER_US;
+	if (fixed_target!=DUAL_TARGET) {
+		//Both glows split off from wherever the glow is now.
+		dual_pos[0]=curr_cathode;
+		dual_pos[1]=curr_cathode;
+		dual_phase[0]=0;
+		dual_phase[1]=0;
+		dual_idx=0;
+		fixed_target=DUAL_TARGET;
+	}
+	portEXIT_CRITICAL(&plan_mux);
+}
+
+//Returns the dwell time in 24.8 timer ticks for a cathode visited 'visits' times per frame.
+static uint32_t plan_dwell(int intens, int total_intens, uint64_t time_left, int visits, int ncath) {
+	uint64_t d;
+	if (total_intens) {
+		d=(intens*time_left)/total_intens;
+	} else {
+		d=time_left/ncath; //nothing lit; divide evenly so the frame rate stays the same
+	}
+	return ((PULSE_MIN_US*TICKS_PER_US)<<8)+d/visits;
+}
+
+static void plan_build(const uint8_t *intens, plan_t *p) {
+	//This tries to set the timings so one 'frame' takes up TIME_ONE_FRAME_US time. It does
+	//that by trying to maximise the time the non-zero-intensity cathodes are lit, which
+	//means spending as few minimum pulses as possible on the unlit ones.
 	int total_intens=0;
 	for (int i=0; i<30; i++) {
 		total_intens+=intens[i];
 	}
 
-	int time_left=TIME_ONE_FRAME_US-(30*PULSE_MIN_US);
+	//Find the longest (circular) run of unlit cathodes; everything else is the arc we
+	//need to cover.
+	int gap_start=0, gap_len=0;
 	for (int i=0; i<30; i++) {
-		delay_per_cathode_us[i]=PULSE_MIN_US+((intens[i]*time_left)/total_intens);
+		int n=0;
+		while (n<30 && intens[(i+n)%30]==0) n++;
+		if (n>gap_len) {
+			gap_start=i;
+			gap_len=n;
+		}
+	}
+	int arc_start=(gap_start+gap_len)%30;
+	int arc_len=30-gap_len;
+
+	memset(p, 0, sizeof(*p));
+	if (arc_len>0 && 2*(arc_len-1)<30) {
+		//Oscillate: arc_start+1 ... arc_end, then back down to arc_start. The ends get
+		//visited once per frame, the cathodes in between twice.
+		int nsteps=(arc_len==1)?1:2*(arc_len-1);
+		uint64_t time_left=((uint64_t)(TIME_ONE_FRAME_US-(nsteps*PULSE_MIN_US))*TICKS_PER_US)<<8;
+		for (int i=0; i<nsteps; i++) {
+			int off=(arc_len==1)?0:(i<arc_len-1)?(i+1):(2*(arc_len-1)-i-1);
+			int c=(arc_start+off)%30;
+			int visits=(off==0 || off==arc_len-1)?1:2;
+			p->step[i].cathode=c;
+			p->step[i].delay_fp=plan_dwell(intens[c], total_intens, time_left, visits, arc_len);
+			p->visit_fp[c]=p->step[i].delay_fp;
+		}
+		p->len=nsteps;
+	} else {
+		//Full sweep is cheaper (or needed)
+		uint64_t time_left=((uint64_t)(TIME_ONE_FRAME_US-(30*PULSE_MIN_US))*TICKS_PER_US)<<8;
+		for (int i=0; i<30; i++) {
+			int c=(arc_start+1+i)%30;
+			p->step[i].cathode=c;
+			p->step[i].delay_fp=plan_dwell(intens[c], total_intens, time_left, 1, 30);
+			p->visit_fp[c]=p->step[i].delay_fp;
+		}
+		p->len=30;
 	}
-	fixed_target=NO_FIXED_TARGET;
+}
+
+static void deka_set_intens(uint8_t *intens) {
+	plan_t p;
+	plan_build(intens, &p);
+
+	portENTER_CRITICAL(&plan_mux);
+	//Animations re-set the same pattern every tick; don't restart the dither for that.
+	plan_t *cmp=plan_pending?next_plan:active_plan;
+	int same=(fixed_target==NO_FIXED_TARGET && cmp->len==p.len);
+	for (int i=0; same && i<p.len; i++) {
+		if (cmp->step[i].cathode!=p.step[i].cathode || cmp->step[i].delay_fp!=p.step[i].delay_fp) same=0;
+	}
+	if (!same) {
+		*next_plan=p;
+		plan_pending=1;
+		//Coming from a fixed target, the ISR isn't walking a plan; start at the top.
+		if (fixed_target!=NO_FIXED_TARGET) plan_idx=0;
+		fixed_target=NO_FIXED_TARGET;
+	}
+	portEXIT_CRITICAL(&plan_mux);
 }
 
 
@@ -155,6 +489,7 @@ typedef struct {
 	int type;
 	int subtype;
 	int speed; //actually delay in us
+	int speed2; //delay of the ccw glow, for DEKA_ANIM_TYPE_DUAL
 	int duration_ms;
 } deka_cmd_t;
 
@@ -167,7 +502,7 @@ static void ledc_init(void) {
 		.timer_num		  = LEDC_TIMER_0,
 		.duty_resolution  = LEDC_TIMER_9_BIT,
 		.freq_hz		  = 40000,
-		.clk_cfg		  = LEDC_AUTO_CLK
+		.clk_cfg		  = LEDC_USE_XTAL_CLK	//so the frequency doesn't change with DFS
 	};
 	ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
 
@@ -180,70 +515,191 @@ static void ledc_init(void) {
 		.duty			= 256
 	};
 	ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+	//Keep the boost transistor off (output high, as duty is inverted) until deka_start().
+	ESP_ERROR_CHECK(ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 1));
 }
 
 
-static adc_oneshot_unit_handle_t adc1_handle;
+static adc_continuous_handle_t adc_handle;
 static adc_cali_handle_t adc_cali_handle;
 
+/*
+HV regulation. The ADC runs in continuous (DMA) mode; every conversion frame gets averaged
+into one oversampled reading which feeds a PI controller. Note the sample rate is deliberately
+not a submultiple of the 40KHz boost frequency, so the ripple averages out instead of aliasing
+into a DC offset.
+*/
+#define HV_ADC_SAMPLE_HZ 23000
+#define HV_ADC_FRAME_SAMPLES 100	//so one frame, and one regulation step, is ~4.3ms
+#define HV_ADC_FRAME_BYTES (HV_ADC_FRAME_SAMPLES*SOC_ADC_DIGI_DATA_BYTES_PER_CONV)
+
+#define HV_TGT_MV 480			//ADC voltage equivalent of 400V
+#define HV_RAMP_MS 200			//soft-start: ramp setpoint up over this time to limit overshoot
+#define HV_DUTY_START 256
+#define HV_DUTY_MIN 15
+#define HV_DUTY_MAX 511
+//PI gains, in duty units per mV of error and per mV*second of error
+#define HV_KP 0.08f
+#define HV_KI 4.0f
+#define HV_SETTLE_BAND_MV (HV_TGT_MV/50)	//2%
+#define HV_SETTLE_HOLD_MS 100
+
+static deka_hv_stats_t hv_stats={.settle_ms=-1};
+
+#if CONFIG_DEKA_USBPD_PPS
+/*
+Input voltage optimization on PPS supplies. At a low input voltage the boost needs long
+on-times and high peak inductor currents, so conduction losses go up; at a high input
+voltage the regulator backs off to short pulses where switching and ringing losses
+dominate. So, slowly move the input voltage to keep the (settled) PWM value inside a
+window around the middle of its range.
+*/
+#define PPS_ADJ_INTERVAL_MS 2000	//also gives the PI loop time to settle after a change
+#define PPS_STEP_MV 200
+#define PPS_PWM_LO (HV_DUTY_START-48)	//below this, the boost works too hard: raise Vin
+#define PPS_PWM_HI (HV_DUTY_START+48)	//above this, it idles: lower Vin
+
+static void pps_adjust(int duty, int64_t now) {
+	static int64_t last_us;
+	static int duty_sum, duty_n;
+	duty_sum+=duty;
+	duty_n++;
+	if (now-last_us<PPS_ADJ_INTERVAL_MS*1000) return;
+	int avg=duty_sum/duty_n;
+	last_us=now;
+	duty_sum=0;
+	duty_n=0;
+	int mv, min_mv, max_mv;
+	if (hv_stats.settle_ms<0 || !usbpd_esp_pps_get(&mv, &min_mv, &max_mv)) return;
+	//Remember duty is inverted: low value means a lot of boosting.
+	int new_mv=mv;
+	if (avg<PPS_PWM_LO) new_mv=mv+PPS_STEP_MV;
+	if (avg>PPS_PWM_HI) new_mv=mv-PPS_STEP_MV;
+	if (new_mv<min_mv) new_mv=min_mv;
+	if (new_mv>max_mv) new_mv=max_mv;
+	if (new_mv!=mv && usbpd_esp_pps_request(new_mv)==ESP_OK) {
+		ESP_LOGI(TAG, "PPS: avg PWM %d, asking for %d mV", avg, new_mv);
+	}
+}
+#endif
+
 static void deka_power_task(void *arg) {
-	int duty=256;	//current duty cycle
 	//Note that duty is inverted, as in, duty being high generally results in a low boost
-	//output voltage and vice versa.
-	int tgt=480;	//equivalent of 400V
+	//output voltage and vice versa. This means the PI output is subtracted.
+	int duty=HV_DUTY_START;	//current duty cycle
+	float integ=0;
+	float filt_mv=0;
 	int warned=0;
-	int posdet_fix_tmr=0;
+	int64_t posdet_decay_us=0;
+	int64_t start_us=esp_timer_get_time();
+	int64_t last_us=start_us;
+	int64_t in_band_since=-1;
+	int crossed=0;
+	uint8_t buf[HV_ADC_FRAME_BYTES];
+
+	ESP_ERROR_CHECK(ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty));
+	ESP_ERROR_CHECK(ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0));
+	ESP_ERROR_CHECK(adc_continuous_start(adc_handle));
 	while(1) {
-		int adc_raw, voltage;
-		ESP_ERROR_CHECK(adc_oneshot_read(adc1_handle, IO_ADC_HV, &adc_raw));
-		ESP_ERROR_CHECK(adc_cali_raw_to_voltage(adc_cali_handle, adc_raw, &voltage));
-
-		//Very slow and simple regulation loop. It's fine, there is a fair amount of tolerance
-		//on the dekatron voltages, and the fact that this starts a bit slow generally is
-		//acceptable.
-		if (voltage<tgt) duty--; else duty++;
-		
-		//upper and lower bound for duty, so we don't blow up the boost transistor
-		//if e.g. the adc reads the wrong value somehow
-		if (duty<15) {
-			duty=15;
+		uint32_t len=0;
+		esp_err_t r=adc_continuous_read(adc_handle, buf, sizeof(buf), &len, 100);
+		if (r!=ESP_OK) {
+			//Should not happen unless the DMA stalls; don't regulate on stale data.
+			ESP_LOGW(TAG, "adc_continuous_read: %s", esp_err_to_name(r));
+			continue;
+		}
+		//Oversample: average the frame, also keep track of min/max for the ripple figure.
+		int sum=0, n=0, min=4095, max=0;
+		for (int i=0; i<len; i+=SOC_ADC_DIGI_DATA_BYTES_PER_CONV) {
+			adc_digi_output_data_t *d=(adc_digi_output_data_t*)&buf[i];
+			if (d->type2.channel!=IO_ADC_HV) continue;
+			int v=d->type2.data;
+			sum+=v;
+			if (v<min) min=v;
+			if (v>max) max=v;
+			n++;
+		}
+		if (n==0) continue;
+		int voltage, min_mv, max_mv;
+		ESP_ERROR_CHECK(adc_cali_raw_to_voltage(adc_cali_handle, (sum+n/2)/n, &voltage));
+		ESP_ERROR_CHECK(adc_cali_raw_to_voltage(adc_cali_handle, min, &min_mv));
+		ESP_ERROR_CHECK(adc_cali_raw_to_voltage(adc_cali_handle, max, &max_mv));
+		//Light IIR on top of the oversampling to knock down the remaining noise.
+		if (filt_mv==0) filt_mv=voltage;
+		filt_mv+=(voltage-filt_mv)*0.5f;
+
+		int64_t now=esp_timer_get_time();
+		float dt=(now-last_us)/1000000.0f;
+		last_us=now;
+		int run_ms=(now-start_us)/1000;
+
+		int tgt=HV_TGT_MV;
+		if (run_ms<HV_RAMP_MS) tgt=(HV_TGT_MV*run_ms)/HV_RAMP_MS;
+		float err=tgt-filt_mv;
+
+		//PI with conditional integration as anti-windup: if the output is already
+		//clamped, don't integrate further into the direction that caused it.
+		float new_integ=integ+err*dt*HV_KI;
+		float out=HV_DUTY_START-(err*HV_KP+new_integ);
+		if (out<HV_DUTY_MIN) {
+			out=HV_DUTY_MIN;
+			if (err<0) integ=new_integ;
 			if (!warned) {
 				ESP_LOGW(TAG, "PWM duty cycle bumped against max limit!");
 				warned=1;
 			}
+		} else if (out>HV_DUTY_MAX) {
+			out=HV_DUTY_MAX;
+			if (err>0) integ=new_integ;
+		} else {
+			integ=new_integ;
+		}
+		
+		//upper and lower bound for duty are enforced above, so we don't blow up the 
+		//boost transistor if e.g. the adc reads the wrong value somehow
+		if ((int)out!=duty) {
+			duty=out;
+			ESP_ERROR_CHECK(ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty));
+			ESP_ERROR_CHECK(ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0));
 		}
-		if (duty>511) duty=511;
-		//Set the duty cycle and wait.
-		ESP_ERROR_CHECK(ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty));
-		ESP_ERROR_CHECK(ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0));
 		curr_pwm=duty;
-		vTaskDelay(pdMS_TO_TICKS(50));
+#if CONFIG_DEKA_USBPD_PPS
+		pps_adjust(duty, now);
+#endif
 
-
-		posdet_fix_tmr++;
-		if (posdet_fix_tmr>30) {
-			posdet_fix_tmr=0;
-			int max_hits=0;
-			int max_hit_pos=0;
-			for (int i=0; i<30; i++) {
-				int j=posdet_hit[i];
-				posdet_hit[i]=0;
-				if (j>max_hits) {
-					max_hits=j;
-					max_hit_pos=0;
+		//Step response statistics
+		int ripple=max_mv-min_mv;
+		hv_stats.hv_mv=filt_mv;
+		hv_stats.tgt_mv=HV_TGT_MV;
+		hv_stats.ripple_mv+=(ripple-hv_stats.ripple_mv)/8;
+		if (filt_mv>=HV_TGT_MV) crossed=1;
+		if (crossed && filt_mv-HV_TGT_MV>hv_stats.overshoot_mv) hv_stats.overshoot_mv=filt_mv-HV_TGT_MV;
+		if (hv_stats.settle_ms<0) {
+			if (fabsf(HV_TGT_MV-filt_mv)<=HV_SETTLE_BAND_MV) {
+				if (in_band_since<0) in_band_since=now;
+				if (now-in_band_since>=HV_SETTLE_HOLD_MS*1000) {
+					hv_stats.settle_ms=(in_band_since-start_us)/1000;
+					ESP_LOGI(TAG, "HV settled in %d ms, overshoot %d mV, ripple %d mVpp", 
+							hv_stats.settle_ms, hv_stats.overshoot_mv, hv_stats.ripple_mv);
 				}
+			} else {
+				in_band_since=-1;
 			}
-			if (max_hits>5) {
-				int c=rotation-max_hit_pos;
-				if (c<0) c+=30;
-				atomic_fetch_add(&rot_corr, c);
-			}
 		}
+
+		int decay=0;
+		if (now-posdet_decay_us>=POSDET_DECAY_MS*1000) {
+			posdet_decay_us=now;
+			decay=1;
+		}
+		posdet_track(decay);
 	}
 }
 
 
 static TaskHandle_t deka_anim_task_handle;
+static atomic_int skip_anim=0;
+static atomic_int hv_running=0;
 
 void IRAM_ATTR esp_timer_cb(void *arg) {
 	int hi_prio_awoken=0;
@@ -279,18 +735,26 @@ void deka_anim_task() {
 			timerexpired=ulTaskNotifyTakeIndexed(0, pdTRUE, pdMS_TO_TICKS(200));
 			//see if we need to / can switch to a new animation
 			int64_t time_ran_ms=(esp_timer_get_time()-anim_start)/1000;
-			if (time_ran_ms>=cur_anim.duration_ms) {
+			if (time_ran_ms>=cur_anim.duration_ms || atomic_load(&skip_anim)) {
 				if (xQueueReceive(deka_cmd_queue, &cur_anim, 0)) {
-					esp_timer_restart(timerhandle, cur_anim.speed);
+					atomic_store(&skip_anim, 0);
+					esp_timer_restart(timerhandle, (cur_anim.type==DEKA_ANIM_TYPE_DUAL)?DUAL_TICK_US:cur_anim.speed);
 					anim_start=esp_timer_get_time();
+					//The first traffic display the tube actually shows ends the boot sequence
+					int spin=(cur_anim.type==DEKA_ANIM_TYPE_SPIN || cur_anim.type==DEKA_ANIM_TYPE_DUAL);
+					if (spin && atomic_load(&hv_running)) {
+						boottime_mark(BOOT_EV_FIRST_SPIN);
+					}
 				}
 			}
 		} while (!timerexpired);
 		//render a frame of the animation
 		if (cur_anim.type==DEKA_ANIM_TYPE_SPIN) {
-			if (cur_anim.subtype) fixed_target--; else fixed_target++;
-			if (fixed_target<0) fixed_target+=30;
-			if (fixed_target>29) fixed_target-=30;
+			//Coming from a pattern or two glows, continue from wherever the glow is.
+			int pos=(fixed_target<0)?curr_cathode:fixed_target;
+			deka_set_pos(cur_anim.subtype?pos-1:pos+1);
+		} else if (cur_anim.type==DEKA_ANIM_TYPE_DUAL) {
+			deka_set_dual(cur_anim.speed, cur_anim.speed2);
 		} else if (cur_anim.type==DEKA_ANIM_TYPE_CHAR) {
 			int c=0;
 			while (font[c].c!=0 && font[c].c!=cur_anim.subtype) c++;
@@ -298,6 +762,14 @@ void deka_anim_task() {
 				if (font[c].lit&(1<<i)) fb[i]=255; else fb[i]=0;
 			}
 			deka_set_intens(fb);
+		} else if (cur_anim.type==DEKA_ANIM_TYPE_BLINK) {
+			int c=0;
+			int ch=(frame&1)?'.':cur_anim.subtype;
+			while (font[c].c!=0 && font[c].c!=ch) c++;
+			for (int i=0; i<30; i++) {
+				if (font[c].lit&(1<<i)) fb[i]=255; else fb[i]=0;
+			}
+			deka_set_intens(fb);
 		} else if (cur_anim.type==DEKA_ANIM_TYPE_GOOGLE) {
 			int size=(sinf((float)frame/32)*14)+15;
 			int startpos=((frame/4)%30)-size/2;
@@ -320,9 +792,40 @@ void deka_queue_anim(int type, int subtype, int speed_us, int duration_ms) {
 	cmd.subtype=subtype;
 	cmd.speed=speed_us;
 	cmd.duration_ms=duration_ms;
+	slog_rec_t rec={
+		.type=SLOG_REC_ANIM,
+		.a=(type<<16)|(subtype&0xffff),
+		.b=speed_us,
+		.c=duration_ms
+	};
+	samplelog_add(&rec);
 	xQueueSend(deka_cmd_queue, &cmd, portMAX_DELAY);
 }
 
+void deka_queue_dual(int delay_cw_us, int delay_ccw_us, int duration_ms) {
+	deka_cmd_t cmd={0};
+	cmd.type=DEKA_ANIM_TYPE_DUAL;
+	cmd.speed=delay_cw_us;
+	cmd.speed2=delay_ccw_us;
+	cmd.duration_ms=duration_ms;
+	slog_rec_t rec={
+		.type=SLOG_REC_ANIM,
+		.a=(DEKA_ANIM_TYPE_DUAL<<16),
+		.b=delay_cw_us,
+		.c=delay_ccw_us
+	};
+	samplelog_add(&rec);
+	xQueueSend(deka_cmd_queue, &cmd, portMAX_DELAY);
+}
+
+void deka_flush_anims() {
+	slog_rec_t rec={.type=SLOG_REC_FLUSH};
+	samplelog_add(&rec);
+	xQueueReset(deka_cmd_queue);
+	atomic_store(&skip_anim, 1);
+	xTaskNotifyGiveIndexed(deka_anim_task_handle, 0);
+}
+
 void deka_set_rotation(int r) {
 	rotation=r;
 }
@@ -335,8 +838,98 @@ int deka_get_posdet_ct() {
 	return posdet_hit_total;
 }
 
+void deka_get_refresh_stats(deka_refresh_stats_t *st) {
+	static uint32_t last_frames, last_visits[30];
+	static uint64_t last_ticks[30];
+	static int64_t last_time;
+	int64_t now=esp_timer_get_time();
+	uint32_t f=frames;
+	memset(st, 0, sizeof(*st));
+	if (last_time!=0 && now!=last_time) {
+		st->refresh_hz_x10=((uint64_t)(f-last_frames)*10000000ULL)/(now-last_time);
+	}
+	st->target_hz=CONFIG_DEKA_REFRESH_HZ;
+	//Compare the average on-time each cathode actually got to what it should get.
+	for (int i=0; i<30; i++) {
+		uint32_t v=cathode_visits[i];
+		uint64_t t=cathode_ticks[i];
+		uint32_t dv=v-last_visits[i];
+		if (last_time!=0 && dv!=0 && fixed_target==NO_FIXED_TARGET && active_plan->visit_fp[i]) {
+			double got=(double)(t-last_ticks[i])/dv;
+			double want=active_plan->visit_fp[i]/256.0;
+			int err=fabs(got-want)*1000000.0/want;
+			if (err>st->linearity_err_ppm) st->linearity_err_ppm=err;
+		}
+		last_visits[i]=v;
+		last_ticks[i]=t;
+	}
+	last_frames=f;
+	last_time=now;
+}
+
+uint32_t deka_bench_plan(const uint8_t *intens) {
+	plan_t p;
+	uint32_t start=esp_cpu_get_cycle_count();
+	plan_build(intens, &p);
+	return esp_cpu_get_cycle_count()-start;
+}
+
+uint32_t deka_bench_timer_step() {
+	gptimer_alarm_event_data_t ev={0};
+	//Run one step with interrupts off, then put the glow back where it was.
+	portENTER_CRITICAL(&plan_mux);
+	int corr=atomic_exchange(&rot_corr, 0);
+	int cc=curr_cathode, pc=prev_cathode, pi=plan_idx;
+	int dpos[2]={dual_pos[0], dual_pos[1]}, didx=dual_idx;
+	uint32_t dphase[2]={dual_phase[0], dual_phase[1]};
+	uint32_t f=frames;
+	uint64_t ss=step_start;
+	uint32_t start=esp_cpu_get_cycle_count();
+	timer_cb(gptimer, &ev, TIMER_CB_BENCH);
+	uint32_t cycles=esp_cpu_get_cycle_count()-start;
+	curr_cathode=cc;
+	prev_cathode=pc;
+	plan_idx=pi;
+	memcpy(dual_pos, dpos, sizeof(dpos));
+	memcpy(dual_phase, dphase, sizeof(dphase));
+	dual_idx=didx;
+	frames=f;
+	step_start=ss;
+	atomic_fetch_add(&rot_corr, corr);
+#if CONFIG_DEKA_DEDIC_GPIO
+	dedic_gpio_cpu_ll_write_all(guide_pat[curr_cathode]<<guide_out_off);
+#else
+	gpio_set_level(IO_G2, (guide_pat[curr_cathode]&GUIDE_G2)?1:0);
+	gpio_set_level(IO_G1, (guide_pat[curr_cathode]&GUIDE_G1)?1:0);
+#endif
+	portEXIT_CRITICAL(&plan_mux);
+	return cycles;
+}
+
+void deka_get_isr_stats(uint32_t *calls, uint32_t *isr_us, uint32_t *max_cycles, uint32_t *max_late_us) {
+	//isr_ticks is 64-bit, so keep the ISR from updating it halfway through the read
+	portENTER_CRITICAL(&plan_mux);
+	uint64_t ticks=isr_ticks;
+	*calls=isr_calls;
+	*max_cycles=isr_max_cycles;
+	*max_late_us=isr_max_late/TICKS_PER_US;
+	isr_max_cycles=0;
+	isr_max_late=0;
+	portEXIT_CRITICAL(&plan_mux);
+	*isr_us=ticks/TICKS_PER_US;
+}
+
+uint32_t deka_get_isr_glitches() {
+	return isr_glitches;
+}
+
+void deka_get_hv_stats(deka_hv_stats_t *st) {
+	*st=hv_stats;
+}
+
 void deka_init() {
-	deka_cmd_queue=xQueueCreate(16, sizeof(deka_cmd_t));
+	deka_cmd_queue=MEM_QUEUE(16, sizeof(deka_cmd_t));
+	rtostrace_watch_queue(deka_cmd_queue, "deka_cmd_queue");
 	ledc_init();
 
 	gpio_config_t cfg={
@@ -344,22 +937,39 @@ void deka_init() {
 		.mode=GPIO_MODE_OUTPUT
 	};
 	gpio_config(&cfg);
+#if CONFIG_DEKA_POWER_SAVE
+	//Keep driving the guides while in light sleep, or the glow may wander off.
+	gpio_sleep_sel_dis(IO_G1);
+	gpio_sleep_sel_dis(IO_G2);
+	gpio_sleep_sel_dis(IO_BOOST);
+#endif
 	gpio_config_t cfg_in={
 		.pin_bit_mask=(1<<IO_POSDET),
-		.mode=GPIO_MODE_INPUT
+		.mode=GPIO_MODE_INPUT,
+		.intr_type=GPIO_INTR_NEGEDGE
 	};
 	gpio_config(&cfg_in);
 
-	adc_oneshot_unit_init_cfg_t init_config1 = {
-		.unit_id = ADC_UNIT_1,
+	adc_continuous_handle_cfg_t adc_config = {
+		.max_store_buf_size = HV_ADC_FRAME_BYTES*4,
+		.conv_frame_size = HV_ADC_FRAME_BYTES,
 	};
-	ESP_ERROR_CHECK(adc_oneshot_new_unit(&init_config1, &adc1_handle));
+	ESP_ERROR_CHECK(adc_continuous_new_handle(&adc_config, &adc_handle));
 
-	adc_oneshot_chan_cfg_t config = {
-		.bitwidth = ADC_BITWIDTH_DEFAULT,
+	adc_digi_pattern_config_t adc_pattern = {
 		.atten = ADC_ATTEN_DB_0,
+		.channel = IO_ADC_HV,
+		.unit = ADC_UNIT_1,
+		.bit_width = SOC_ADC_DIGI_MAX_BITWIDTH,
+	};
+	adc_continuous_config_t dig_cfg = {
+		.sample_freq_hz = HV_ADC_SAMPLE_HZ,
+		.conv_mode = ADC_CONV_SINGLE_UNIT_1,
+		.format = ADC_DIGI_OUTPUT_FORMAT_TYPE2,
+		.pattern_num = 1,
+		.adc_pattern = &adc_pattern,
 	};
-	ESP_ERROR_CHECK(adc_oneshot_config_channel(adc1_handle, IO_ADC_HV, &config));
+	ESP_ERROR_CHECK(adc_continuous_config(adc_handle, &dig_cfg));
 
 	adc_cali_curve_fitting_config_t cali_config = {
 		.unit_id = ADC_UNIT_1,
@@ -369,36 +979,69 @@ void deka_init() {
 	};
 	ESP_ERROR_CHECK(adc_cali_create_scheme_curve_fitting(&cali_config, &adc_cali_handle));
 	
-	gptimer_handle_t gptimer = NULL;
 	gptimer_config_t timer_config = {
 		.clk_src = GPTIMER_CLK_SRC_DEFAULT,
 		.direction = GPTIMER_COUNT_UP,
-		.resolution_hz = 1000000, // 1MHz, 1 tick=1us
+		.resolution_hz = TIMER_HZ,
 	};
 	ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &gptimer));
 
 	//precalculate g1/g2 values
 	for (int x=0; x<30; x++) {
 		int t=x%3;
-		g1_for[x]=(t==2)?1:0;
-		g2_for[x]=(t==1)?1:0;
+		guide_pat[x]=((t==2)?GUIDE_G1:0)|((t==1)?GUIDE_G2:0);
 	}
+#if CONFIG_DEKA_DEDIC_GPIO
+	//Order matters: channel n of the bundle is bit n of guide_pat.
+	int guide_gpios[]={IO_G1, IO_G2};
+	dedic_gpio_bundle_config_t bundle_cfg={
+		.gpio_array=guide_gpios,
+		.array_size=2,
+		.flags={
+			.out_en=1,
+		},
+	};
+	ESP_ERROR_CHECK(dedic_gpio_new_bundle(&bundle_cfg, &guide_bundle));
+	ESP_ERROR_CHECK(dedic_gpio_get_out_offset(guide_bundle, &guide_out_off));
+#endif
 
 	gptimer_event_callbacks_t cbs = {
 		.on_alarm = timer_cb,
 	};
 	ESP_ERROR_CHECK(gptimer_register_event_callbacks(gptimer, &cbs, NULL));
 	gptimer_alarm_config_t alarm_config1 = {
-		.alarm_count = 1000
+		.alarm_count = 1000*TICKS_PER_US
 	};
 	ESP_ERROR_CHECK(gptimer_set_alarm_action(gptimer, &alarm_config1));
-	ESP_ERROR_CHECK(gptimer_enable(gptimer));
-	ESP_ERROR_CHECK(gptimer_start(gptimer));
+	//Note the timer is started in deka_start(): without HV there's nothing to step, and
+	//while enabled, the gptimer driver holds a PM lock that keeps us out of light sleep.
+
+	posdet_queue=MEM_QUEUE(32, sizeof(posdet_ev_t));
+	//IRAM, so the posdet timestamps stay right during flash writes. This means all
+	//handlers on the GPIO ISR service need to be IRAM_ATTR.
+	esp_err_t r=gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+	if (r!=ESP_ERR_INVALID_STATE) ESP_ERROR_CHECK(r); //already installed is fine
+	ESP_ERROR_CHECK(gpio_isr_handler_add(IO_POSDET, posdet_isr, NULL));
 	
-	xTaskCreate(deka_anim_task, "deka_anim", 4096, NULL, 5, &deka_anim_task_handle);
+	deka_anim_task_handle=MEM_TASK(deka_anim_task, "deka_anim", 4096, NULL, 5);
 }
 
 
 void deka_start() {
-	xTaskCreate(deka_power_task, "deka_pwr", 4096, NULL, 5, NULL);
+#if CONFIG_PM_ENABLE
+	/*
+	The boost PWM runs from XTAL, so DFS doesn't affect it, but in light sleep both the PWM
+	and the ADC the regulation loop needs stop, leaving the boost transistor in whatever
+	state it was. So no light sleep for as long as the HV is up, which, as the tube has no
+	off state, is from here on. The ADC DMA driver holds an APB_FREQ_MAX lock while it
+	samples anyway; what DFS can still do is drop the CPU to 80MHz when it's idle.
+	*/
+	esp_pm_lock_handle_t hv_pm_lock;
+	ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "deka_hv", &hv_pm_lock));
+	ESP_ERROR_CHECK(esp_pm_lock_acquire(hv_pm_lock));
+#endif
+	ESP_ERROR_CHECK(gptimer_enable(gptimer));
+	ESP_ERROR_CHECK(gptimer_start(gptimer));
+	MEM_TASK(deka_power_task, "deka_pwr", 4096, NULL, 5);
+	atomic_store(&hv_running, 1);
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
+#pragma once
+
 /*
 Dekatron driver. This can do Fancy Animations as well, by cycling the Dekatron very
 fast and dwelling for variable amount of times on the various cathodes.
 */
+#include <stdint.h>
 
 //Initialize the dekatron driver. Initializes hardware and starts the task that handles
 //all the animations. Note: does not initialize HV power supply.
@@ -13,6 +16,8 @@ void deka_start();
 #define DEKA_ANIM_TYPE_SPIN 0 //subtype = cw (0) / ccw (1)
 #define DEKA_ANIM_TYPE_CHAR 1 //subtype = ascii char
 #define DEKA_ANIM_TYPE_GOOGLE 2 //Google spinner
+#define DEKA_ANIM_TYPE_BLINK 3 //subtype = ascii char, alternates with a dot every speed_us
+#define DEKA_ANIM_TYPE_DUAL 4 //two glows spinning in opposite directions; use deka_queue_dual
 
 //Queue an animation of the given type and subtype. speed_us depends on the
 //type of animation; it's only used for TYPE_SPIN at this moment where it
@@ -21,12 +26,56 @@ void deka_start();
 //is queued up next, it may play longer than that.
 void deka_queue_anim(int type, int subtype, int speed_us, int duration_ms);
 
+//Queue two glows that spin independently: one clockwise, resting delay_cw_us on every
+//cathode, and one counter-clockwise at delay_ccw_us. The tube alternates between the two
+//fast enough for both to look steady. duration_ms is as for deka_queue_anim.
+void deka_queue_dual(int delay_cw_us, int delay_ccw_us, int duration_ms);
+
+//Drop all queued animations and end the current one as soon as something new is queued.
+void deka_flush_anims();
+
 //Adjust the 'down' position of the dekatron so TYPE_CHAR shows up OK.
 void deka_set_rotation(int r);
 
 //Get the HV regulator PWM value. 0-511.
 int deka_get_pwm();
 
+typedef struct {
+	int hv_mv;			//Filtered HV feedback, as measured on the ADC pin
+	int tgt_mv;			//Regulation target, same units
+	int settle_ms;		//Time from start to within 2% of target, -1 if not settled yet
+	int overshoot_mv;	//Max overshoot over target seen
+	int ripple_mv;		//Peak-peak ripple within one ADC frame, averaged
+} deka_hv_stats_t;
+
+//Get statistics on how well the HV regulator is doing.
+void deka_get_hv_stats(deka_hv_stats_t *st);
+
+typedef struct {
+	int target_hz;			//Configured refresh rate
+	int refresh_hz_x10;		//Full-frame refresh rate achieved, in 0.1Hz
+	int linearity_err_ppm;	//Worst deviation of a cathodes average on-time from what was asked
+} deka_refresh_stats_t;
+
+//Get refresh statistics since the last call. Only meaningful if the tube is multiplexing a
+//static pattern for the entire interval.
+void deka_get_refresh_stats(deka_refresh_stats_t *st);
+
+//Get the amount of cathode ISR invocations and the time spent in them. Calls and
+//isr_us are free-running counters; max_cycles is the longest single invocation in CPU
+//cycles and max_late_us the longest time an alarm waited for the ISR, both since the
+//previous call to this function.
+void deka_get_isr_stats(uint32_t *calls, uint32_t *isr_us, uint32_t *max_cycles, uint32_t *max_late_us);
+
+//Free-running count of cathode steps that came so late the glow visibly stuttered.
+uint32_t deka_get_isr_glitches();
+
+//Benchmark hooks for the console. deka_bench_plan runs the frame planner of
+//deka_set_intens on the given 30-entry pattern without showing it; deka_bench_timer_step
+//runs one cathode ISR step and then restores the glow position. Both return CPU cycles.
+uint32_t deka_bench_plan(const uint8_t *intens);
+uint32_t deka_bench_timer_step();
+
 //Get an indicator for how well the position detector works... finnicky, that one.
 int deka_get_posdet_ct();
 
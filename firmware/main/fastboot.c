@@ -0,0 +1,162 @@
+//Fast warm-boot path: cached AP channel/BSSID, optional static IP, boot timing.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
+#include "esp_event.h"
+#include "lwip/inet.h"
+#include "nvs.h"
+#include "wifi_manager.h"
+#include "webconfig.h"
+#include "fastboot.h"
+#include "wifips.h"
+
+static const char *TAG="fastboot";
+
+typedef struct {
+	char ssid[33];
+	uint8_t bssid[6];
+	uint8_t channel;
+} ap_cache_t;
+
+static ap_cache_t cache;
+static int have_cache=0;
+static int fast_attempt=0;
+static esp_netif_ip_info_t static_ip;
+static esp_ip4_addr_t static_dns;
+static int use_static_ip=0;
+
+static void save_cache() {
+	nvs_handle_t h;
+	if (nvs_open("fastboot", NVS_READWRITE, &h)!=ESP_OK) return;
+	if (have_cache) {
+		nvs_set_blob(h, "ap", &cache, sizeof(cache));
+	} else {
+		nvs_erase_key(h, "ap");
+	}
+	nvs_commit(h);
+	nvs_close(h);
+}
+
+static void wifi_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data) {
+	wifi_config_t *cfg=wifi_manager_get_wifi_sta_config();
+	cfg->sta.listen_interval=wifips_listen_interval();
+	if (id==WIFI_EVENT_STA_CONNECTED) {
+		wifi_event_sta_connected_t *ev=(wifi_event_sta_connected_t*)data;
+		fast_attempt=0;
+		//Only write to flash if something changed.
+		ap_cache_t n={0};
+		memcpy(n.ssid, ev->ssid, ev->ssid_len>32?32:ev->ssid_len);
+		memcpy(n.bssid, ev->bssid, 6);
+		n.channel=ev->channel;
+		if (!have_cache || memcmp(&n, &cache, sizeof(n))!=0) {
+			cache=n;
+			have_cache=1;
+			save_cache();
+			ESP_LOGI(TAG, "Cached AP channel %d for next boot", cache.channel);
+		}
+	} else if (id==WIFI_EVENT_STA_DISCONNECTED && fast_attempt) {
+		//AP moved or is gone. Forget about it, and make the wifi manager do a full
+		//scan when it retries.
+		ESP_LOGW(TAG, "Fast connect failed, falling back to full scan");
+		fast_attempt=0;
+		cfg->sta.bssid_set=false;
+		cfg->sta.channel=0;
+		have_cache=0;
+		save_cache();
+	}
+}
+
+//Called by the wifi manager after it loaded the STA config from flash, but before it
+//uses that to connect.
+static void cb_sta_config_loaded(void *arg) {
+	ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, wifi_event_handler, NULL));
+	ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, wifi_event_handler, NULL));
+	wifi_config_t *cfg=wifi_manager_get_wifi_sta_config();
+	if (have_cache && strcmp((char*)cfg->sta.ssid, cache.ssid)==0) {
+		ESP_LOGI(TAG, "Connecting using cached channel %d", cache.channel);
+		memcpy(cfg->sta.bssid, cache.bssid, 6);
+		cfg->sta.bssid_set=true;
+		cfg->sta.channel=cache.channel;
+		cfg->sta.scan_method=WIFI_FAST_SCAN;
+		fast_attempt=1;
+	}
+	if (use_static_ip) {
+		esp_netif_t *netif=esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+		if (netif) {
+			esp_netif_dhcpc_stop(netif);
+			esp_netif_set_ip_info(netif, &static_ip);
+			esp_netif_dns_info_t dns={0};
+			dns.ip.type=ESP_IPADDR_TYPE_V4;
+			dns.ip.u_addr.ip4=static_dns;
+			esp_netif_set_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns);
+		}
+	}
+}
+
+void fastboot_init() {
+	nvs_handle_t h;
+	if (nvs_open("fastboot", NVS_READONLY, &h)==ESP_OK) {
+		size_t len=sizeof(cache);
+		have_cache=(nvs_get_blob(h, "ap", &cache, &len)==ESP_OK && len==sizeof(cache));
+		nvs_close(h);
+	}
+
+	char ip[16]="", mask[16]="", gw[16]="";
+	webconfig_get_config_str("static_ip", ip, sizeof(ip));
+	webconfig_get_config_str("static_mask", mask, sizeof(mask));
+	webconfig_get_config_str("static_gw", gw, sizeof(gw));
+	if (ip[0]!=0) {
+		static_ip.ip.addr=ipaddr_addr(ip);
+		static_ip.netmask.addr=ipaddr_addr(mask);
+		static_ip.gw.addr=ipaddr_addr(gw);
+		static_dns.addr=static_ip.gw.addr; //gateway generally also does DNS
+		use_static_ip=(static_ip.ip.addr!=IPADDR_NONE && static_ip.netmask.addr!=IPADDR_NONE);
+		if (!use_static_ip) ESP_LOGW(TAG, "Invalid static IP config, using DHCP");
+	}
+	wifi_manager_set_callback(WM_ORDER_LOAD_AND_RESTORE_STA, &cb_sta_config_loaded);
+}
+
+int fastboot_ip_changed(const char *ip) {
+	nvs_handle_t h;
+	char last[16]={0};
+	size_t len=sizeof(last);
+	if (nvs_open("fastboot", NVS_READWRITE, &h)!=ESP_OK) return 1;
+	int changed=1;
+	if (nvs_get_str(h, "last_ip", last, &len)==ESP_OK) changed=(strcmp(last, ip)!=0);
+	if (changed) {
+		nvs_set_str(h, "last_ip", ip);
+		nvs_commit(h);
+	}
+	nvs_close(h);
+	return changed;
+}
+
+static int64_t boot_ev_us[BOOT_EV_COUNT];
+static const char *boot_ev_name[BOOT_EV_COUNT]={"got_ip", "usb_pd", "hv_start", "first_sample", "first_spin"};
+
+void boottime_mark(int ev) {
+	if (boot_ev_us[ev]!=0) return;
+	boot_ev_us[ev]=esp_timer_get_time();
+	ESP_LOGI(TAG, "Boot milestone %s at %d ms", boot_ev_name[ev], (int)(boot_ev_us[ev]/1000));
+}
+
+int boottime_get_ms(int ev) {
+	if (boot_ev_us[ev]==0) return -1;
+	return boot_ev_us[ev]/1000;
+}
+
+const char *boottime_name(int ev) {
+	return boot_ev_name[ev];
+}
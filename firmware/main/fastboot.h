@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Warm-boot helpers. We remember the channel and BSSID of the AP we last connected to, so on
+the next boot we can skip the full WiFi scan, and optionally use a static IP instead of DHCP.
+This also keeps timestamps of the boot milestones so we can see where the time goes.
+*/
+
+//Load the cached WiFi info and hook into the wifi manager. Call this right after
+//wifi_manager_start(), while no higher-priority task can have run yet.
+void fastboot_init();
+
+//Returns 1 if this IP differs from the one we had last time (and remembers it).
+int fastboot_ip_changed(const char *ip);
+
+#define BOOT_EV_GOT_IP 0
+#define BOOT_EV_PD 1
+#define BOOT_EV_HV_START 2
+#define BOOT_EV_FIRST_SAMPLE 3
+#define BOOT_EV_FIRST_SPIN 4
+#define BOOT_EV_COUNT 5
+
+//Record the time of a boot milestone. Only the first call per event counts.
+void boottime_mark(int ev);
+
+//Get the time a milestone happened in ms since boot, or -1 if it didn't happen yet.
+int boottime_get_ms(int ev);
+
+//Get the name of a milestone, for reporting.
+const char *boottime_name(int ev);
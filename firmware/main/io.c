@@ -14,12 +14,14 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "esp_sleep.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "io.h"
 #include "driver/gpio.h"
 
 int led_r_state=0, led_g_state=0;
+static esp_timer_handle_t blink_timer;
 
 
 static void set_led(int gpio, int state, int t) {
@@ -41,13 +43,25 @@ void blink_callback() {
 void io_led_blink_set(int led, int blink) {
 	if (led==LED_RED) led_r_state=blink;
 	if (led==LED_GREEN) led_g_state=blink;
+	//Only keep the blink timer running if something is actually blinking, so
+	//it doesn't keep waking up the CPU. Start/stop error out harmlessly if the
+	//timer already is in the state we want.
+	if (led_r_state==BLINK_SLOW || led_r_state==BLINK_FAST || 
+			led_g_state==BLINK_SLOW || led_g_state==BLINK_FAST) {
+		esp_timer_start_periodic(blink_timer, 200000);
+	} else {
+		esp_timer_stop(blink_timer);
+		set_led(IO_LEDR, led_r_state, 0);
+		set_led(IO_LEDG, led_g_state, 0);
+	}
 }
 
 void io_init() {
 	gpio_config_t cfg_in={
 		.pin_bit_mask=(1<<IO_BTN),
 		.mode=GPIO_MODE_INPUT,
-		.pull_up_en=GPIO_PULLUP_ENABLE
+		.pull_up_en=GPIO_PULLUP_ENABLE,
+		.intr_type=GPIO_INTR_LOW_LEVEL
 	};
 	gpio_config(&cfg_in);
 	gpio_config_t cfg_out={
@@ -55,14 +69,19 @@ void io_init() {
 		.mode=GPIO_MODE_OUTPUT,
 	};
 	gpio_config(&cfg_out);
+#if CONFIG_DEKA_POWER_SAVE
+	//LEDs should stay as they are in light sleep; the button should wake us up.
+	gpio_sleep_sel_dis(IO_LEDR);
+	gpio_sleep_sel_dis(IO_LEDG);
+	gpio_wakeup_enable(IO_BTN, GPIO_INTR_LOW_LEVEL);
+	esp_sleep_enable_gpio_wakeup();
+#endif
 
 	const esp_timer_create_args_t blink_timer_args = {
 		.callback = &blink_callback,
 		.name = "blink"
 	};
-	esp_timer_handle_t blink_timer;
 	ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer));
-	ESP_ERROR_CHECK(esp_timer_start_periodic(blink_timer, 200000));
 }
 
 int io_btn_pressed() {
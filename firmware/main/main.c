@@ -8,16 +8,21 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "driver/ledc.h"
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "esp_pm.h"
+#include "esp_wifi.h"
+#include "esp_sntp.h"
 #include "esp_adc/adc_oneshot.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
 #include "usbpd_esp.h"
 #include "driver/i2c.h"
 #include "dekatron.h"
@@ -27,15 +32,34 @@
 #include "snmpgetter.h"
 #include "webconfig.h"
 #include "io.h"
+#include "taskstats.h"
+#include "membudget.h"
+#include "fastboot.h"
+#include "snmptrap.h"
+#include "snmpagent.h"
+#include "ratecalc.h"
+#include "samplelog.h"
+#include "benchcon.h"
+#include "blog.h"
+#include "trafstats.h"
+#include "wifips.h"
+#include "rtostrace.h"
 
 static const char *TAG="main";
 
-static SemaphoreHandle_t deka_start_sema;
+static SemaphoreHandle_t got_ip_sema;
 
 /*
 Callback for USB-PD driver. We want 12V but are also happy with 9 or 15V.
 */
 static int prefered_idx=0;
+//Input voltage range for PPS supplies; same span as the fixed PDOs we accept. The
+//HV regulator moves the voltage around within this to keep the boost efficient.
+#define PPS_MIN_MV 9000
+#define PPS_MAX_MV 15000
+#define PPS_START_MV 12000
+#define PPS_MIN_MA 1000
+
 static int usbpd_cb(int type, int mv, int ma) {
 	const int preference[]={15000, 9000, 12000, 0}; //most prefered is last
 	if (type==USBPD_ESP_CB_INITIAL) prefered_idx=0;
@@ -51,7 +75,20 @@ static int usbpd_cb(int type, int mv, int ma) {
 				can_start=1;
 			}
 		}
-		if (can_start) xSemaphoreGive(deka_start_sema);
+		int pps_mv, pps_min, pps_max;
+		if (usbpd_esp_pps_get(&pps_mv, &pps_min, &pps_max)) {
+			//PPS range is limited to what the boost converter can take when we set it
+			io_led_blink_set(LED_RED, BLINK_OFF);
+			can_start=1;
+		}
+		boottime_mark(BOOT_EV_PD);
+		//Start the HV supply right away; no need to wait for the network to come up.
+		static int hv_started=0;
+		if (can_start && !hv_started) {
+			hv_started=1;
+			deka_start();
+			boottime_mark(BOOT_EV_HV_START);
+		}
 	} else {
 		for (int i=0; preference[i]!=0; i++) {
 			if (mv==preference[i] && prefered_idx<=i) {
@@ -73,8 +110,13 @@ static SemaphoreHandle_t conn_flag_mutex;
 
 static void set_conn_flag(int bitmask, int set) {
 	xSemaphoreTake(conn_flag_mutex, portMAX_DELAY);
+	int old=conn_flags;
 	if (set) conn_flags|=bitmask; else conn_flags&=~bitmask;
-	printf("Conn flags %x\n", conn_flags);
+	if (conn_flags==old) {
+		xSemaphoreGive(conn_flag_mutex);
+		return;
+	}
+	BLOG("Conn flags %x", conn_flags);
 	if (conn_flags&FLAG_AP) {
 		io_led_blink_set(LED_GREEN, BLINK_ON);
 	} else if ((conn_flags&FLAG_CONNECTED)==0) {
@@ -93,15 +135,35 @@ static void cb_connection_ok(void *pvParameter) {
 	char str_ip[32];
 	esp_ip4addr_ntoa(&param->ip_info.ip, str_ip, 32);
 	ESP_LOGI(TAG, "I have a connection and my IP is %s!", str_ip);
-	for (int i=0; str_ip[i]!=0; i++) {
-		deka_queue_anim(DEKA_ANIM_TYPE_CHAR, str_ip[i], 10000, 2000);
+	RTOSTRACE_MARK(RTOSTRACE_MARK_WIFI_GOT_IP, param->ip_info.ip.addr);
+	boottime_mark(BOOT_EV_GOT_IP);
+	//Modem sleep profile as configured. With the tube on, that and DFS down to 80MHz is
+	//all the power saving there is; the HV supply keeps the chip out of light sleep.
+	wifips_apply();
+	//Show the IP, depending on config. Note a short press on the button skips this.
+	char show_ip[16]="always";
+	webconfig_get_config_str("show_ip", show_ip, sizeof(show_ip));
+	int ip_changed=fastboot_ip_changed(str_ip);
+	if (strcmp(show_ip, "always")==0 || (strcmp(show_ip, "changed")==0 && ip_changed)) {
+		for (int i=0; str_ip[i]!=0; i++) {
+			deka_queue_anim(DEKA_ANIM_TYPE_CHAR, str_ip[i], 10000, 2000);
+		}
+		deka_queue_anim(DEKA_ANIM_TYPE_SPIN, 0, 10000, 0);
+	}
+	//Wall clock time, for the daily traffic statistics.
+	if (!sntp_enabled()) {
+		sntp_setoperatingmode(SNTP_OPMODE_POLL);
+		sntp_setservername(0, "pool.ntp.org");
+		sntp_init();
 	}
-	deka_queue_anim(DEKA_ANIM_TYPE_SPIN, 0, 10000, 0);
 	set_conn_flag(FLAG_CONNECTED, 1);
+	xSemaphoreGive(got_ip_sema);
 }
 
 static void cb_connection_disconnected(void *pvParameter) {
 	set_conn_flag(FLAG_CONNECTED, 0);
+	wifips_disconnected();
+	RTOSTRACE_MARK(RTOSTRACE_MARK_WIFI_DISCONNECT, 0);
 }
 
 static void cb_connection_apstart(void *pvParameter) {
@@ -122,29 +184,46 @@ static void dekatron_start() {
 	webconfig_get_config_str("oid_out", oid_out, sizeof(oid_out));
 	ESP_LOGI(TAG, "Using config snmpip=%s community=%s oid_in=%s oid_out=%s", 
 			snmpip, community, oid_in, oid_out);
+	//The ifIndex is the last component of the ifInOctets OID.
+	char *idx=strrchr(oid_in, '.');
+	trafstats_start(idx?atoi(idx+1):-1);
 	snmpgetter_start(snmpip, 161, community, oid_in, oid_out);
-	char rot_str[16];
-	webconfig_get_config_str("rotation", rot_str, sizeof(rot_str));
-	deka_set_rotation(atoi(rot_str));
+	char trap_oids[256]="";
+	webconfig_get_config_str("trap_oids", trap_oids, sizeof(trap_oids));
+	snmptrap_start(idx?atoi(idx+1):-1, trap_oids);
+	char agent_community[64]="";
+	webconfig_get_config_str("agent_community", agent_community, sizeof(agent_community));
+	snmpagent_start(agent_community);
 }
 
 //This allows you to enter something like '0.92G' and it'll parse it to a proper
 //value.
 static uint64_t get_max_bw() {
-	char bw_str[16];
+	char bw_str[16]="";
 	webconfig_get_config_str("max_bw_bps", bw_str, sizeof(bw_str));
-	float f=atof(bw_str);
-	char ind=bw_str[strlen(bw_str)-1];
-	if (ind=='g' || ind=='G') f=f*1024*1024*1024;
-	if (ind=='m' || ind=='M') f=f*1024*1024;
-	if (ind=='k' || ind=='K') f=f*1024;
-	return f;
+	return ratecalc_parse_bw(bw_str);
 }
 
 
 
 #define PRESS_DUR_LONG 30 //3 seconds
-//called every 100ms
+static esp_timer_handle_t btn_timer;
+
+//The button timer only runs while the button is pressed. A low level on the button
+//fires this interrupt, which starts it.
+static void btn_timer_start(void *arg, uint32_t unused) {
+	esp_timer_start_periodic(btn_timer, 100000);
+}
+
+//IRAM_ATTR as the GPIO ISR service is IRAM-safe; see deka_init.
+static void IRAM_ATTR btn_isr(void *arg) {
+	gpio_intr_disable(IO_BTN);
+	BaseType_t hi_prio_awoken=pdFALSE;
+	xTimerPendFunctionCallFromISR(btn_timer_start, NULL, 0, &hi_prio_awoken);
+	if (hi_prio_awoken) portYIELD_FROM_ISR();
+}
+
+//called every 100ms while the button is pressed
 void btn_callback(void *arg) {
 	static int press_dur=0;
 	if (io_btn_pressed()) {
@@ -156,28 +235,42 @@ void btn_callback(void *arg) {
 		}
 	} else {
 		if (press_dur!=0 && press_dur<PRESS_DUR_LONG) {
-			//short pressed
+			//short pressed: skip whatever is showing, e.g. the IP address
+			deka_flush_anims();
 		}
 		press_dur=0;
+		esp_timer_stop(btn_timer);
+		gpio_intr_enable(IO_BTN);
 	}
 }
 
 void app_main(void) {
+#if CONFIG_DEKA_POWER_SAVE
+	esp_pm_config_t pm_config={
+		.max_freq_mhz=CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+		.min_freq_mhz=40, //XTAL
+		.light_sleep_enable=true
+	};
+	ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+#endif
 	io_init();
+	blog_start();
+	taskstats_start();
+	samplelog_start();
 	io_led_blink_set(LED_RED, BLINK_SLOW);
 	io_led_blink_set(LED_GREEN, BLINK_SLOW);
 	
-	deka_start_sema=xSemaphoreCreateBinary();
-	conn_flag_mutex=xSemaphoreCreateMutex();
+	got_ip_sema=MEM_SEMA_BINARY();
+	conn_flag_mutex=MEM_MUTEX();
 	const esp_timer_create_args_t btn_timer_args = {
 		.callback = &btn_callback,
 		.name = "btn"
 	};
-	esp_timer_handle_t btn_timer;
 	ESP_ERROR_CHECK(esp_timer_create(&btn_timer_args, &btn_timer));
-	ESP_ERROR_CHECK(esp_timer_start_periodic(btn_timer, 100000));
 
 	deka_init();
+	//note: deka_init installs the GPIO ISR service
+	ESP_ERROR_CHECK(gpio_isr_handler_add(IO_BTN, btn_isr, NULL));
 
 	int i2c_master_port = 0;
 
@@ -191,45 +284,72 @@ void app_main(void) {
 	};
 	ESP_ERROR_CHECK(i2c_param_config(i2c_master_port, &conf));
 	ESP_ERROR_CHECK(i2c_driver_install(i2c_master_port, conf.mode, 0, 0, 0));
+#if CONFIG_DEKA_USBPD_PPS
+	usbpd_esp_set_pps_range(PPS_MIN_MV, PPS_MAX_MV, PPS_START_MV, PPS_MIN_MA);
+#endif
 	ESP_ERROR_CHECK(usbpd_esp_init(i2c_master_port, usbpd_cb));
 
+	//Note webconfig needs to be up before the wifi manager, as fastboot reads its config.
+	webconfig_start();
+	char rot_str[16];
+	webconfig_get_config_str("rotation", rot_str, sizeof(rot_str));
+	deka_set_rotation(atoi(rot_str));
+	char tz[64]="UTC0";
+	webconfig_get_config_str("tz", tz, sizeof(tz));
+	setenv("TZ", tz, 1);
+	tzset();
+	wifips_init();
+
+	//Make sure the wifi manager task can't run before we've hooked our callbacks into it.
+	UBaseType_t prio=uxTaskPriorityGet(NULL);
+	vTaskPrioritySet(NULL, CONFIG_WIFI_MANAGER_TASK_PRIORITY+1);
 	wifi_manager_start();
+	fastboot_init();
 	wifi_manager_set_callback(WM_EVENT_STA_GOT_IP, &cb_connection_ok);
 	wifi_manager_set_callback(WM_ORDER_DISCONNECT_STA, &cb_connection_disconnected);
 	wifi_manager_set_callback(WM_ORDER_START_AP, &cb_connection_apstart);
 	wifi_manager_set_callback(WM_ORDER_STOP_AP, &cb_connection_apstop);
-	webconfig_start();
+	vTaskPrioritySet(NULL, prio);
 
-	dekatron_start();
+	membudget_start();
+#if CONFIG_DEKA_BENCH_CONSOLE
+	benchcon_start();
+#endif
 
 	//note: field is in *bit* per second so we convert to *bytes* per second as
 	//everything else is in bytes per second as well.
 	uint64_t max_bw_bps=get_max_bw()/8;
+	//In dual mode, in and out each get their own glow instead of sharing one.
+	char mode_str[16]="single";
+	webconfig_get_config_str("display_mode", mode_str, sizeof(mode_str));
+	int dual=(strcmp(mode_str, "dual")==0);
 
-	//Wait for succesful USB PD negotiation to start HV PSU
-	ESP_LOGI(TAG, "Wait for USB-PD negotiations");
+	//USB-PD negotiation and HV startup happen in the background; we only need the
+	//network to start polling.
 	set_conn_flag(FLAG_SNMP, 1); //to stop blinking green LED
-	xSemaphoreTake(deka_start_sema, portMAX_DELAY);
-	deka_start();
+	xSemaphoreTake(got_ip_sema, portMAX_DELAY);
+	dekatron_start();
 
 	ESP_LOGI(TAG, "Snmpgetter query start");
 	while(1) {
 		snmpgetter_bw_t bw;
 		int r=0;
 		do {
-			r=snmpgetter_get_bw(&bw, pdMS_TO_TICKS(2000));
-			set_conn_flag(FLAG_SNMP, r);
+			r=snmpgetter_get_bw(&bw, pdMS_TO_TICKS(1000));
+			set_conn_flag(FLAG_SNMP, r || snmpgetter_alive());
 		} while (!r);
-		ESP_LOGI(TAG, "in %d Kbps out %d Kbps", bw.bps_in/1024, bw.bps_out/1024);
-		float max_speed_rps=20;
-		float speed_in_rps=(max_speed_rps*bw.bps_in)/max_bw_bps;
-		float speed_out_rps=(max_speed_rps*bw.bps_out)/max_bw_bps;
-		float speed_rps=(speed_in_rps>speed_out_rps)?speed_in_rps:speed_out_rps;
-		if (speed_rps>max_speed_rps) speed_rps=max_speed_rps;
-		if (speed_rps<0.01) speed_rps=0.01; //don't divide by zero
-		int delay_us=((1000000.0/30)/speed_rps);
-		//printf("speed_rps %f delay %d\n", speed_rps, delay_us);
-		deka_queue_anim(DEKA_ANIM_TYPE_SPIN, (bw.bps_in>bw.bps_out)?1:0, delay_us, 0);
-		vTaskDelay(pdMS_TO_TICKS(500));
+		boottime_mark(BOOT_EV_FIRST_SAMPLE);
+		BLOG_RL(5000, "in %d Kbps out %d Kbps", bw.bps_in/1024, bw.bps_out/1024);
+		if (dual) {
+			//Same directions as the single glow: inbound traffic spins counter-clockwise.
+			deka_queue_dual(ratecalc_glow_delay_us(bw.bps_out, max_bw_bps),
+					ratecalc_glow_delay_us(bw.bps_in, max_bw_bps), 0);
+		} else {
+			int ccw;
+			int delay_us=ratecalc_spin_delay_us(&bw, max_bw_bps, &ccw);
+			//printf("delay %d\n", delay_us);
+			deka_queue_anim(DEKA_ANIM_TYPE_SPIN, ccw, delay_us, 0);
+		}
+		//note: no delay needed, snmpgetter_get_bw blocks until the next sample is in
 	}
 }
@@ -0,0 +1,70 @@
+//Memory budget report and heap growth watchdog.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "membudget.h"
+
+static const char *TAG="membudget";
+
+#define CHECK_INTERVAL_US (60*1000*1000ULL)
+#define GROWTH_WARN_BYTES 4096	//warn every time heap use grows this much over the baseline
+
+#if CONFIG_DEKA_STATIC_ALLOC
+#define ALLOC_MODE "static alloc mode"
+#else
+#define ALLOC_MODE "heap alloc mode"
+#endif
+
+static size_t static_bytes=0;
+static size_t baseline=0;
+static size_t warned_at=0;
+
+void membudget_add_static(size_t bytes) {
+	static_bytes+=bytes;
+}
+
+void membudget_get(membudget_t *mb) {
+	mb->static_bytes=static_bytes;
+	mb->heap_total=heap_caps_get_total_size(MALLOC_CAP_DEFAULT);
+	mb->heap_used=mb->heap_total-heap_caps_get_free_size(MALLOC_CAP_DEFAULT);
+	mb->heap_min_free=heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+	mb->heap_largest=heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT);
+	mb->heap_baseline=baseline;
+}
+
+static void check_cb(void *arg) {
+	membudget_t mb;
+	membudget_get(&mb);
+	if (mb.heap_used>=warned_at+GROWTH_WARN_BYTES) {
+		ESP_LOGW(TAG, "Heap use grew to %d bytes, %d over the baseline. Min free ever %d, largest block %d.",
+				(int)mb.heap_used, (int)(mb.heap_used-baseline), (int)mb.heap_min_free, (int)mb.heap_largest);
+		warned_at=mb.heap_used;
+	}
+}
+
+void membudget_start() {
+	membudget_t mb;
+	membudget_get(&mb);
+	baseline=mb.heap_used;
+	warned_at=baseline;
+	ESP_LOGI(TAG, "Memory budget: static %d bytes (" ALLOC_MODE "), heap %d/%d bytes used, min free ever %d, largest free block %d",
+			(int)mb.static_bytes, (int)mb.heap_used, (int)mb.heap_total, (int)mb.heap_min_free, (int)mb.heap_largest);
+
+	const esp_timer_create_args_t args={
+		.callback=check_cb,
+		.name="membudget"
+	};
+	esp_timer_handle_t t;
+	ESP_ERROR_CHECK(esp_timer_create(&args, &t));
+	ESP_ERROR_CHECK(esp_timer_start_periodic(t, CHECK_INTERVAL_US));
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+/*
+Memory budget. The MEM_* macros create the long-lived RTOS objects; with
+CONFIG_DEKA_STATIC_ALLOC they use static buffers (accounted for in the budget report),
+otherwise they allocate from the heap as usual. Note the macros declare their static
+buffers at the call site, so they must only be used for objects created once.
+*/
+
+#if CONFIG_DEKA_STATIC_ALLOC
+#define MEM_TASK(fn, name, stack, arg, prio) ({ \
+		static StackType_t stk_[stack]; static StaticTask_t tcb_; \
+		membudget_add_static(sizeof(stk_)+sizeof(tcb_)); \
+		xTaskCreateStatic(fn, name, stack, arg, prio, stk_, &tcb_); })
+#define MEM_QUEUE(len, itemsize) ({ \
+		static uint8_t buf_[(len)*(itemsize)]; static StaticQueue_t q_; \
+		membudget_add_static(sizeof(buf_)+sizeof(q_)); \
+		xQueueCreateStatic(len, itemsize, buf_, &q_); })
+#define MEM_SEMA_BINARY() ({ \
+		static StaticSemaphore_t s_; membudget_add_static(sizeof(s_)); \
+		xSemaphoreCreateBinaryStatic(&s_); })
+#define MEM_MUTEX() ({ \
+		static StaticSemaphore_t s_; membudget_add_static(sizeof(s_)); \
+		xSemaphoreCreateMutexStatic(&s_); })
+#else
+#define MEM_TASK(fn, name, stack, arg, prio) ({ \
+		TaskHandle_t h_=NULL; xTaskCreate(fn, name, stack, arg, prio, &h_); h_; })
+#define MEM_QUEUE(len, itemsize) xQueueCreate(len, itemsize)
+#define MEM_SEMA_BINARY() xSemaphoreCreateBinary()
+#define MEM_MUTEX() xSemaphoreCreateMutex()
+#endif
+
+//Account for statically allocated bytes in the budget report.
+void membudget_add_static(size_t bytes);
+
+//Print the memory budget and start watching the heap. Call this when the system is
+//done initializing; heap use at that point is the baseline for the growth warnings.
+void membudget_start();
+
+typedef struct {
+	size_t static_bytes;	//Statically allocated via the MEM_* macros
+	size_t heap_total;
+	size_t heap_used;
+	size_t heap_min_free;	//Minimum free heap ever
+	size_t heap_largest;	//Largest free block
+	size_t heap_baseline;	//Heap use when membudget_start() was called
+} membudget_t;
+
+void membudget_get(membudget_t *mb);
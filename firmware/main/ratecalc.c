@@ -0,0 +1,57 @@
+// Bandwidth and spin speed calculations, shared between the firmware and the host tools.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ratecalc.h"
+
+int ratecalc_update(ratecalc_t *rc, int64_t ts_us, int64_t in_bytes, int64_t out_bytes, snmpgetter_bw_t *bw) {
+	int ret=0;
+	if (ts_us==rc->ts_last) return 0;
+	if (rc->ts_last!=0) {
+		int64_t time_us=ts_us-rc->ts_last;
+		int64_t diff_in=in_bytes-rc->in_last;
+		int64_t diff_out=out_bytes-rc->out_last;
+		//Fix rollover. Note that this assumes a 32-bit response from in_bytes/out_bytes. Given we
+		//don't support 64-bit things yet, this will always be the case.
+		if (diff_in<0) diff_in+=(1ULL<<32);
+		if (diff_out<0) diff_out+=(1ULL<<32);
+		bw->bps_in=(diff_in*1000000ULL)/time_us;
+		bw->bps_out=(diff_out*1000000ULL)/time_us;
+		ret=1;
+	}
+	rc->ts_last=ts_us;
+	rc->in_last=in_bytes;
+	rc->out_last=out_bytes;
+	return ret;
+}
+
+uint64_t ratecalc_parse_bw(const char *str) {
+	int l=strlen(str);
+	if (l==0) return 0;
+	float f=atof(str);
+	char ind=str[l-1];
+	if (ind=='g' || ind=='G') f=f*1024*1024*1024;
+	if (ind=='m' || ind=='M') f=f*1024*1024;
+	if (ind=='k' || ind=='K') f=f*1024;
+	return f;
+}
+
+int ratecalc_glow_delay_us(int bps, uint64_t max_bw) {
+	float max_speed_rps=20;
+	float speed_rps=(max_speed_rps*bps)/max_bw;
+	if (speed_rps>max_speed_rps) speed_rps=max_speed_rps;
+	if (speed_rps<0.01) speed_rps=0.01; //don't divide by zero
+	return ((1000000.0/30)/speed_rps);
+}
+
+int ratecalc_spin_delay_us(const snmpgetter_bw_t *bw, uint64_t max_bw, int *ccw) {
+	*ccw=(bw->bps_in>bw->bps_out)?1:0;
+	return ratecalc_glow_delay_us((bw->bps_in>bw->bps_out)?bw->bps_in:bw->bps_out, max_bw);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include "snmpgetter.h"
+
+/*
+The math that turns raw interface counters into a bandwidth, and a bandwidth into a spin
+speed. This is kept free of ESP-IDF dependencies so the host tools can replay a trace through
+the exact same code.
+*/
+
+typedef struct {
+	int64_t in_last;
+	int64_t out_last;
+	int64_t ts_last;
+} ratecalc_t;
+
+//Feed a pair of counter samples taken at ts_us. Returns 1 and fills in bw if a bandwidth
+//could be calculated (i.e. this is not the first sample).
+int ratecalc_update(ratecalc_t *rc, int64_t ts_us, int64_t in_bytes, int64_t out_bytes, snmpgetter_bw_t *bw);
+
+//Parse a bandwidth in bits per second with an optional k/M/G suffix, e.g. '0.92G'.
+uint64_t ratecalc_parse_bw(const char *str);
+
+//Map a bandwidth to the delay per cathode for a spin animation. max_bw is in bytes per
+//second. Sets *ccw to the spin direction.
+int ratecalc_spin_delay_us(const snmpgetter_bw_t *bw, uint64_t max_bw, int *ccw);
+
+//Map a single rate in bytes per second to the delay per cathode of one glow. This is
+//what the dual glow display uses for in and out separately.
+int ratecalc_glow_delay_us(int bps, uint64_t max_bw);
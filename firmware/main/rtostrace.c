@@ -0,0 +1,173 @@
+//Timeline trace of context switches, the cathode ISR, watched queues and markers.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "rtostrace.h"
+
+#if CONFIG_DEKA_RTOSTRACE
+
+#define NEV CONFIG_DEKA_RTOSTRACE_EVENTS
+
+/*
+Everything here can be called from the kernel, with the scheduler in the middle of a
+context switch, or from the cathode ISR with the flash cache off. So: IRAM functions, data
+in DRAM, and no locks besides masking interrupts, which is enough on the single-core C3.
+*/
+static DRAM_ATTR rtostrace_ev_t ring[NEV];
+static uint32_t pos;			//events written since the last download
+static uint32_t stop_at;		//pos at which to stop, if triggered
+static int triggered, stopped;
+static void *queues[RTOSTRACE_MAX_QUEUES];
+static char queue_names[RTOSTRACE_MAX_QUEUES][RTOSTRACE_NAME_LEN];
+
+static const char *isr_names[RTOSTRACE_ISR_COUNT]={"cathode ISR"};
+static const char *mark_names[RTOSTRACE_MARK_COUNT]={"HTTP GET", "HTTP POST", "WiFi got IP",
+		"WiFi disconnect", "SNMP poll", "NVS flush"};
+
+void IRAM_ATTR rtostrace_add(int type, int id, uint32_t arg) {
+	UBaseType_t state=portSET_INTERRUPT_MASK_FROM_ISR();
+	if (!stopped) {
+		rtostrace_ev_t *ev=&ring[pos%NEV];
+		ev->ts=esp_timer_get_time();
+		ev->type=type;
+		ev->id=id;
+		ev->arg=arg;
+		pos++;
+		if (triggered && pos==stop_at) stopped=1;
+	}
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+void IRAM_ATTR rtostrace_trigger() {
+	UBaseType_t state=portSET_INTERRUPT_MASK_FROM_ISR();
+	if (!triggered && !stopped) {
+		rtostrace_add(RTOSTRACE_EV_TRIGGER, 0, 0);
+		triggered=1;
+		stop_at=pos+RTOSTRACE_POST_TRIGGER;
+	}
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+void IRAM_ATTR rtostrace_task_in() {
+	rtostrace_add(RTOSTRACE_EV_TASK_IN, 0, (uint32_t)xTaskGetCurrentTaskHandle());
+}
+
+//Every queue and semaphore operation ends up here, so keep the common case quick.
+void IRAM_ATTR rtostrace_queue(void *queue, int type) {
+	for (int i=0; i<RTOSTRACE_MAX_QUEUES; i++) {
+		if (queues[i]==queue) {
+			rtostrace_add(type, i, 0);
+			return;
+		}
+	}
+}
+
+void rtostrace_watch_queue(void *queue, const char *name) {
+	for (int i=0; i<RTOSTRACE_MAX_QUEUES; i++) {
+		if (queues[i]==NULL) {
+			strncpy(queue_names[i], name, RTOSTRACE_NAME_LEN-1);
+			queues[i]=queue;
+			return;
+		}
+	}
+}
+
+static void name_set(rtostrace_name_t *n, uint32_t id, const char *name) {
+	memset(n, 0, sizeof(*n));
+	n->id=id;
+	strncpy(n->name, name, RTOSTRACE_NAME_LEN-1);
+}
+
+int rtostrace_read(int (*cb)(const void *data, size_t len, void *arg), void *arg) {
+	//Nothing that happens during the download is interesting anyway.
+	UBaseType_t state=portSET_INTERRUPT_MASK_FROM_ISR();
+	stopped=1;
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+
+	//Only the tasks that still exist have a name; the converter shows the others by handle.
+	int ntasks=uxTaskGetNumberOfTasks()+2;
+	TaskStatus_t *ts=malloc(ntasks*sizeof(TaskStatus_t));
+	int nnames=RTOSTRACE_MAX_QUEUES+RTOSTRACE_ISR_COUNT+RTOSTRACE_MARK_COUNT;
+	rtostrace_name_t *names=malloc((ntasks+nnames)*sizeof(rtostrace_name_t));
+	int err=0;
+	if (!ts || !names) {
+		ntasks=0;
+		err=1;
+	} else {
+		uint32_t total;
+		ntasks=uxTaskGetSystemState(ts, ntasks, &total);
+		rtostrace_name_t *n=names;
+		for (int i=0; i<ntasks; i++) name_set(n++, (uint32_t)ts[i].xHandle, ts[i].pcTaskName);
+		for (int i=0; i<RTOSTRACE_MAX_QUEUES; i++) name_set(n++, i, queue_names[i]);
+		for (int i=0; i<RTOSTRACE_ISR_COUNT; i++) name_set(n++, i, isr_names[i]);
+		for (int i=0; i<RTOSTRACE_MARK_COUNT; i++) name_set(n++, i, mark_names[i]);
+	}
+
+	uint32_t nev=(pos<NEV)?pos:NEV;
+	rtostrace_hdr_t hdr={
+		.magic=RTOSTRACE_MAGIC,
+		.ts_hz=1000000,
+		.nev=err?0:nev,
+		.lost=pos-nev,
+		.ntasks=ntasks,
+		.nqueues=RTOSTRACE_MAX_QUEUES,
+		.nisrs=RTOSTRACE_ISR_COUNT,
+		.nmarks=RTOSTRACE_MARK_COUNT
+	};
+	if (err) {
+		hdr.nqueues=0;
+		hdr.nisrs=0;
+		hdr.nmarks=0;
+	}
+	if (cb(&hdr, sizeof(hdr), arg)) err=1;
+	if (!err && cb(names, (ntasks+nnames)*sizeof(rtostrace_name_t), arg)) err=1;
+	//Oldest event first; the ring wraps at most once.
+	uint32_t first=(pos-nev)%NEV;
+	uint32_t n1=(first+nev>NEV)?NEV-first:nev;
+	if (!err && cb(&ring[first], n1*sizeof(rtostrace_ev_t), arg)) err=1;
+	if (!err && nev>n1 && cb(&ring[0], (nev-n1)*sizeof(rtostrace_ev_t), arg)) err=1;
+	free(ts);
+	free(names);
+
+	//Re-arm
+	state=portSET_INTERRUPT_MASK_FROM_ISR();
+	pos=0;
+	triggered=0;
+	stopped=0;
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+	return 1;
+}
+
+#else
+
+void rtostrace_add(int type, int id, uint32_t arg) {
+}
+
+void rtostrace_trigger() {
+}
+
+void rtostrace_task_in() {
+}
+
+void rtostrace_queue(void *queue, int type) {
+}
+
+void rtostrace_watch_queue(void *queue, const char *name) {
+}
+
+int rtostrace_read(int (*cb)(const void *data, size_t len, void *arg), void *arg) {
+	return 0;
+}
+
+#endif
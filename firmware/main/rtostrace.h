@@ -0,0 +1,104 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Timeline trace of what the CPU does: context switches (from the FreeRTOS trace hooks, see
+rtostrace_hooks.h), the cathode ISR, operations on a few watched queues, and markers placed
+in the code. Events go into a RAM ring with esp_timer timestamps; /rtostrace downloads it
+and tools/rtostrace_json turns it into Chrome/Perfetto trace JSON.
+
+Not the CPU cycle counter: with DFS, the CPU runs at 160MHz when busy and 80MHz when idle,
+so cycles would stretch idle gaps and busy spans differently. The esp_timer (systimer)
+runs from XTAL and is IRAM-safe, at the cost of 1us resolution.
+
+A late cathode step (see deka_get_isr_glitches) triggers the trace: it then records
+RTOSTRACE_POST_TRIGGER more events and stops, so the ring holds what led up to the
+glitch. Downloading the trace re-arms it. This header is also used by the host tools.
+*/
+
+#define RTOSTRACE_MAGIC 0x32545452	//'RTT2'
+#define RTOSTRACE_NAME_LEN 16
+#define RTOSTRACE_MAX_QUEUES 4
+#define RTOSTRACE_POST_TRIGGER 256
+
+#define RTOSTRACE_EV_TASK_IN 1		//arg=task handle
+#define RTOSTRACE_EV_ISR_ENTER 2	//id=RTOSTRACE_ISR_*
+#define RTOSTRACE_EV_ISR_EXIT 3
+#define RTOSTRACE_EV_QUEUE_SEND 4	//id=watched queue slot
+#define RTOSTRACE_EV_QUEUE_RECV 5
+#define RTOSTRACE_EV_QUEUE_BLOCK_SEND 6
+#define RTOSTRACE_EV_QUEUE_BLOCK_RECV 7
+#define RTOSTRACE_EV_MARK 8			//id=RTOSTRACE_MARK_*, arg=value
+#define RTOSTRACE_EV_MARK_BEGIN 9
+#define RTOSTRACE_EV_MARK_END 10
+#define RTOSTRACE_EV_TRIGGER 11		//recording stops RTOSTRACE_POST_TRIGGER events after this
+
+#define RTOSTRACE_ISR_CATHODE 0
+#define RTOSTRACE_ISR_COUNT 1
+
+#define RTOSTRACE_MARK_HTTP_GET 0
+#define RTOSTRACE_MARK_HTTP_POST 1
+#define RTOSTRACE_MARK_WIFI_GOT_IP 2
+#define RTOSTRACE_MARK_WIFI_DISCONNECT 3
+#define RTOSTRACE_MARK_SNMP_POLL 4
+#define RTOSTRACE_MARK_NVS_FLUSH 5
+#define RTOSTRACE_MARK_COUNT 6
+
+typedef struct {
+	uint32_t ts;		//esp_timer time, lower 32 bits
+	uint16_t type;		//RTOSTRACE_EV_*
+	uint16_t id;
+	uint32_t arg;
+} rtostrace_ev_t;
+
+typedef struct {
+	uint32_t id;		//task handle, queue slot, ISR or marker number
+	char name[RTOSTRACE_NAME_LEN];
+} rtostrace_name_t;
+
+//The download is this header, then ntasks+nqueues+nisrs+nmarks names in that order, then
+//nev events, oldest first.
+typedef struct {
+	uint32_t magic;
+	uint32_t ts_hz;			//ticks per second of ts
+	uint32_t nev;
+	uint32_t lost;			//events overwritten since the last download
+	uint16_t ntasks;
+	uint16_t nqueues;
+	uint16_t nisrs;
+	uint16_t nmarks;
+} rtostrace_hdr_t;
+
+#if CONFIG_DEKA_RTOSTRACE
+#define RTOSTRACE_ISR_ENTER(isr) rtostrace_add(RTOSTRACE_EV_ISR_ENTER, isr, 0)
+#define RTOSTRACE_ISR_EXIT(isr) rtostrace_add(RTOSTRACE_EV_ISR_EXIT, isr, 0)
+#define RTOSTRACE_MARK(mark, val) rtostrace_add(RTOSTRACE_EV_MARK, mark, val)
+#define RTOSTRACE_BEGIN(mark) rtostrace_add(RTOSTRACE_EV_MARK_BEGIN, mark, 0)
+#define RTOSTRACE_END(mark) rtostrace_add(RTOSTRACE_EV_MARK_END, mark, 0)
+#define RTOSTRACE_TRIGGER() rtostrace_trigger()
+#else
+#define RTOSTRACE_ISR_ENTER(isr)
+#define RTOSTRACE_ISR_EXIT(isr)
+#define RTOSTRACE_MARK(mark, val)
+#define RTOSTRACE_BEGIN(mark)
+#define RTOSTRACE_END(mark)
+#define RTOSTRACE_TRIGGER()
+#endif
+
+//Add an event. Safe to call from anywhere, including ISRs with the flash cache off.
+void rtostrace_add(int type, int id, uint32_t arg);
+
+//Stop recording RTOSTRACE_POST_TRIGGER events from now, unless already triggered.
+void rtostrace_trigger();
+
+//Record sends and receives on this queue (a QueueHandle_t).
+void rtostrace_watch_queue(void *queue, const char *name);
+
+//Called from the FreeRTOS trace hooks.
+void rtostrace_task_in();
+void rtostrace_queue(void *queue, int type);
+
+//Stop recording and call cb with the download, in pieces, then re-arm. Stops when cb
+//returns nonzero. Returns 0 if tracing is not enabled.
+int rtostrace_read(int (*cb)(const void *data, size_t len, void *arg), void *arg);
@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+FreeRTOS trace hooks for rtostrace. The project CMakeLists.txt force-includes this file in
+every compilation unit, so FreeRTOS sees these macros before it defines its (empty)
+defaults. It's also seen by assembly files, hence the guard.
+*/
+#ifndef __ASSEMBLER__
+#include "sdkconfig.h"
+#if CONFIG_DEKA_RTOSTRACE
+#include "rtostrace.h"
+#define traceTASK_SWITCHED_IN() rtostrace_task_in()
+#define traceQUEUE_SEND(q) rtostrace_queue(q, RTOSTRACE_EV_QUEUE_SEND)
+#define traceQUEUE_SEND_FROM_ISR(q) rtostrace_queue(q, RTOSTRACE_EV_QUEUE_SEND)
+#define traceQUEUE_RECEIVE(q) rtostrace_queue(q, RTOSTRACE_EV_QUEUE_RECV)
+#define traceQUEUE_RECEIVE_FROM_ISR(q) rtostrace_queue(q, RTOSTRACE_EV_QUEUE_RECV)
+#define traceBLOCKING_ON_QUEUE_SEND(q) rtostrace_queue(q, RTOSTRACE_EV_QUEUE_BLOCK_SEND)
+#define traceBLOCKING_ON_QUEUE_RECEIVE(q) rtostrace_queue(q, RTOSTRACE_EV_QUEUE_BLOCK_RECV)
+#endif
+#endif
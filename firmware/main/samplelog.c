@@ -0,0 +1,203 @@
+// Ring log of samples and animation commands in flash.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "samplelog.h"
+#include "membudget.h"
+
+static const char *TAG="samplelog";
+
+/*
+Wear: we only ever append to erased space, so every sector gets erased once per trip around
+the ring. We log about 4 records a second (a sample plus a spin command, twice a second),
+which fills a sector in ~40 seconds and wraps the 256K partition in ~45 minutes. That's
+about 32 erase cycles per sector per day, so 100K cycles lasts ~8 years.
+
+Records are batched in RAM and written BATCH_RECS at a time, or after FLUSH_MS if it's quiet.
+The cathode ISR is IRAM-safe and keeps stepping while the flash is busy (see dekatron.c);
+tasks are still stalled for the duration of the write, same as for NVS writes.
+*/
+#define BATCH_RECS 16
+#define FLUSH_MS 5000
+
+static const esp_partition_t *part;
+static QueueHandle_t recq;
+static SemaphoreHandle_t flash_mux;
+static int nsectors;
+static int cur_sector=-1;	//sector we're appending to, -1 if we haven't started one this boot
+static int last_sector;		//newest sector from before this boot
+static int cur_rec;
+static uint32_t next_seq;
+static uint16_t boot;
+static int recs_written=0, recs_dropped=0, flash_errors=0;
+
+//Erase the next sector in the ring and write its header. Needs flash_mux.
+static esp_err_t start_sector() {
+	cur_sector=(cur_sector+1)%nsectors;
+	esp_err_t r=esp_partition_erase_range(part, cur_sector*SLOG_SECTOR_SIZE, SLOG_SECTOR_SIZE);
+	if (r!=ESP_OK) return r;
+	slog_hdr_t hdr={
+		.magic=SLOG_MAGIC,
+		.seq=next_seq++,
+		.boot=boot,
+		.rec_size=sizeof(slog_rec_t)
+	};
+	r=esp_partition_write(part, cur_sector*SLOG_SECTOR_SIZE, &hdr, sizeof(hdr));
+	cur_rec=0;
+	return r;
+}
+
+static esp_err_t write_batch(const slog_rec_t *recs, int n) {
+	esp_err_t r=ESP_OK;
+	xSemaphoreTake(flash_mux, portMAX_DELAY);
+	if (cur_sector==-1) cur_sector=last_sector;
+	while (n && r==ESP_OK) {
+		if (cur_rec==0 || cur_rec==SLOG_RECS_PER_SECTOR) {
+			r=start_sector();
+			if (r!=ESP_OK) break;
+		}
+		int c=SLOG_RECS_PER_SECTOR-cur_rec;
+		if (c>n) c=n;
+		int off=cur_sector*SLOG_SECTOR_SIZE+sizeof(slog_hdr_t)+cur_rec*sizeof(slog_rec_t);
+		r=esp_partition_write(part, off, recs, c*sizeof(slog_rec_t));
+		cur_rec+=c;
+		recs+=c;
+		n-=c;
+		if (r==ESP_OK) recs_written+=c;
+	}
+	xSemaphoreGive(flash_mux);
+	return r;
+}
+
+static void samplelog_task(void *arg) {
+	slog_rec_t batch[BATCH_RECS];
+	int n=0;
+	TickType_t deadline=0;
+	while(1) {
+		TickType_t wait=portMAX_DELAY;
+		if (n) {
+			int32_t left=deadline-xTaskGetTickCount();
+			wait=(left>0)?left:0;
+		}
+		if (xQueueReceive(recq, &batch[n], wait)) {
+			if (n==0) deadline=xTaskGetTickCount()+pdMS_TO_TICKS(FLUSH_MS);
+			n++;
+			if (n<BATCH_RECS) continue;
+		}
+		if (n) {
+			esp_err_t r=write_batch(batch, n);
+			if (r!=ESP_OK) {
+				//The trace is a debugging aid; not worth taking the clock down for. Stop
+				//logging and leave whatever made it to flash readable.
+				ESP_LOGE(TAG, "Writing trace to flash failed: %s. Stopping the trace log.", esp_err_to_name(r));
+				flash_errors++;
+				recs_dropped+=n;
+				recq=NULL;
+				vTaskDelete(NULL);
+			}
+		}
+		n=0;
+	}
+}
+
+//Find where we left off last boot.
+static void find_head() {
+	slog_hdr_t hdr;
+	int found=0;
+	uint32_t max_seq=0;
+	uint16_t max_boot=0;
+	for (int i=0; i<nsectors; i++) {
+		ESP_ERROR_CHECK(esp_partition_read(part, i*SLOG_SECTOR_SIZE, &hdr, sizeof(hdr)));
+		if (hdr.magic!=SLOG_MAGIC || hdr.rec_size!=sizeof(slog_rec_t)) continue;
+		if (!found || hdr.seq>max_seq) {
+			max_seq=hdr.seq;
+			max_boot=hdr.boot;
+			last_sector=i;
+		}
+		found=1;
+	}
+	if (found) {
+		next_seq=max_seq+1;
+		boot=max_boot+1;
+	} else {
+		//Empty partition; start at sector 0.
+		last_sector=nsectors-1;
+		next_seq=0;
+		boot=0;
+	}
+}
+
+void samplelog_start() {
+	part=esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "trace");
+	if (!part) {
+		ESP_LOGW(TAG, "No trace partition, not logging samples.");
+		return;
+	}
+	nsectors=part->size/SLOG_SECTOR_SIZE;
+	find_head();
+	ESP_LOGI(TAG, "Trace log: %d sectors, boot %d, seq %d", nsectors, boot, (int)next_seq);
+	flash_mux=MEM_MUTEX();
+	recq=MEM_QUEUE(BATCH_RECS*2, sizeof(slog_rec_t));
+	MEM_TASK(samplelog_task, "samplelog", 3072, NULL, 2);
+}
+
+void samplelog_add(slog_rec_t *rec) {
+	//The writer clears recq if it gives up; the queue itself stays allocated.
+	QueueHandle_t q=recq;
+	if (!q) return;
+	if (rec->ts_us==0) rec->ts_us=esp_timer_get_time();
+	if (!xQueueSend(q, rec, 0)) recs_dropped++;
+}
+
+uint16_t samplelog_rtt(int64_t us) {
+	int64_t r=us/100;
+	if (r<0) return 0;
+	if (r>0xffff) return 0xffff;
+	return r;
+}
+
+int samplelog_read(int (*cb)(const uint8_t *sector, void *arg), void *arg) {
+	if (!part || !flash_mux) return 0;
+	uint8_t *buf=malloc(SLOG_SECTOR_SIZE);
+	if (!buf) return 0;
+	const slog_hdr_t *hdr=(const slog_hdr_t*)buf;
+	//Sectors are written in ring order, so the oldest sector is the one after the newest.
+	xSemaphoreTake(flash_mux, portMAX_DELAY);
+	int first=((cur_sector==-1)?last_sector:cur_sector)+1;
+	xSemaphoreGive(flash_mux);
+	int sent=0;
+	for (int i=0; i<nsectors; i++) {
+		int s=(first+i)%nsectors;
+		//Take the mutex per sector, so we don't block the writer for the entire download.
+		xSemaphoreTake(flash_mux, portMAX_DELAY);
+		esp_err_t r=esp_partition_read(part, s*SLOG_SECTOR_SIZE, buf, SLOG_SECTOR_SIZE);
+		xSemaphoreGive(flash_mux);
+		if (r!=ESP_OK) break;
+		if (hdr->magic!=SLOG_MAGIC || hdr->rec_size!=sizeof(slog_rec_t)) continue;
+		sent++;
+		if (cb(buf, arg)) break;
+	}
+	free(buf);
+	return sent;
+}
+
+void samplelog_get_stats(int *written, int *dropped, int *errors) {
+	*written=recs_written;
+	*dropped=recs_dropped;
+	*errors=flash_errors;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Sample trace recorder. Keeps a ring log of raw counter samples, round-trip times and
+animation commands in the 'trace' flash partition, so we can see (and replay on a PC,
+see tools/) what a spinner in the field actually saw.
+
+Flash layout: the partition is a ring of 4K sectors. Each sector starts with a header,
+followed by fixed-size records. Unwritten records read as all-ones (type 0xff).
+*/
+
+#define SLOG_MAGIC 0x474f4c53 //'SLOG'
+#define SLOG_SECTOR_SIZE 4096
+
+typedef struct {
+	uint32_t magic;
+	uint32_t seq;		//Sector sequence number, increments for every sector written
+	uint16_t boot;		//Boot counter, so replays can tell where the device rebooted
+	uint16_t rec_size;	//sizeof(slog_rec_t)
+	uint32_t reserved;
+} slog_hdr_t;
+
+#define SLOG_REC_SAMPLE 1	//a=in counter, b=out counter, c=0
+#define SLOG_REC_ANIM 2		//a=type<<16|subtype, b=speed_us, c=duration_ms
+							//for DEKA_ANIM_TYPE_DUAL: b=cw delay, c=ccw delay
+#define SLOG_REC_FLUSH 3	//animation queue was flushed
+#define SLOG_REC_EMPTY 0xff
+
+#define SLOG_FLAG_IN_OK (1<<0)
+#define SLOG_FLAG_OUT_OK (1<<1)
+#define SLOG_FLAG_ALIASED (1<<2)	//counters hadn't been updated by the agent yet, not used for the rate
+
+typedef struct {
+	uint32_t ts_us;		//esp_timer time, lower 32 bits. Only differences are meaningful.
+	uint8_t type;		//SLOG_REC_*
+	uint8_t flags;		//SLOG_FLAG_*
+	uint16_t rtt_in;	//Round trip times of the in/out requests, in 100us units, saturating.
+	uint16_t rtt_out;
+	uint16_t reserved;
+	uint32_t a, b, c;
+} slog_rec_t;
+
+#define SLOG_RECS_PER_SECTOR ((SLOG_SECTOR_SIZE-sizeof(slog_hdr_t))/sizeof(slog_rec_t))
+
+//Find the trace partition and start the writer task.
+void samplelog_start();
+
+//Log a record. ts_us is filled in if it's 0. Never blocks; drops the record if the writer
+//can't keep up.
+void samplelog_add(slog_rec_t *rec);
+
+//Convert a round trip time in us into the units used in the log.
+uint16_t samplelog_rtt(int64_t us);
+
+//Call cb for all written sectors, oldest first, e.g. to send them over HTTP. Stops when cb
+//returns nonzero. Returns the amount of sectors handed to cb.
+int samplelog_read(int (*cb)(const uint8_t *sector, void *arg), void *arg);
+
+//Amount of records written and dropped since boot, and flash write errors. The log stops
+//at the first error.
+void samplelog_get_stats(int *written, int *dropped, int *errors);
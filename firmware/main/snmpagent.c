@@ -0,0 +1,328 @@
+// SNMP agent for the device's own telemetry.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "snmppdu.h"
+#include "snmpagent.h"
+#include "snmpgetter.h"
+#include "snmptrap.h"
+#include "dekatron.h"
+#include "membudget.h"
+
+static const char *TAG="snmpagent";
+
+#define ERR_TOOBIG 1
+#define ERR_NOSUCHNAME 2
+#define ERR_GENERR 5
+#define ERR_NOTWRITABLE 17
+
+//v2c varbind exceptions
+#define EXC_NOSUCHOBJECT 0x80
+#define EXC_ENDOFMIBVIEW 0x82
+
+#define MAX_OID_TLV 32
+#define RESP_SIZE 512
+
+typedef struct {
+	int sub;
+	int type;
+	uint32_t (*get)();
+	int oid[12];
+	char oid_tlv[MAX_OID_TLV];	//pre-encoded, filled in at start
+	int oid_tlv_len;
+} agent_obj_t;
+
+static uint32_t get_hv_mv() {
+	deka_hv_stats_t st;
+	deka_get_hv_stats(&st);
+	return st.hv_mv;
+}
+
+static uint32_t get_hv_tgt_mv() {
+	deka_hv_stats_t st;
+	deka_get_hv_stats(&st);
+	return st.tgt_mv;
+}
+
+static uint32_t get_pwm() {
+	return deka_get_pwm();
+}
+
+static uint32_t get_posdet() {
+	return deka_get_posdet_ct();
+}
+
+static uint32_t get_poll_requests() {
+	snmpgetter_stats_t st;
+	snmpgetter_get_stats(&st);
+	return st.requests;
+}
+
+static uint32_t get_poll_timeouts() {
+	snmpgetter_stats_t st;
+	snmpgetter_get_stats(&st);
+	return st.timeouts;
+}
+
+static uint32_t get_poll_errors() {
+	snmpgetter_stats_t st;
+	snmpgetter_get_stats(&st);
+	return st.errors+st.decode_fail;
+}
+
+static uint32_t get_poll_rtt() {
+	snmpgetter_stats_t st;
+	snmpgetter_get_stats(&st);
+	return st.rtt_last_us;
+}
+
+static uint32_t get_heap_free() {
+	return esp_get_free_heap_size();
+}
+
+static uint32_t get_heap_min_free() {
+	return esp_get_minimum_free_heap_size();
+}
+
+static uint32_t get_uptime() {
+	return esp_timer_get_time()/10000;
+}
+
+static uint32_t get_traps() {
+	int rx, shown;
+	snmptrap_get_stats(&rx, &shown);
+	return rx;
+}
+
+//Needs to be sorted by sub-identifier for GETNEXT to work.
+static agent_obj_t objs[]={
+	{1, PRIM_GAUGE32, get_hv_mv},
+	{2, PRIM_GAUGE32, get_hv_tgt_mv},
+	{3, PRIM_GAUGE32, get_pwm},
+	{4, PRIM_CTR32, get_posdet},
+	{5, PRIM_CTR32, get_poll_requests},
+	{6, PRIM_CTR32, get_poll_timeouts},
+	{7, PRIM_CTR32, get_poll_errors},
+	{8, PRIM_GAUGE32, get_poll_rtt},
+	{9, PRIM_GAUGE32, get_heap_free},
+	{10, PRIM_GAUGE32, get_heap_min_free},
+	{11, PRIM_TIMETICKS, get_uptime},
+	{12, PRIM_CTR32, get_traps},
+};
+#define NOBJS (sizeof(objs)/sizeof(objs[0]))
+
+static int sockfd;
+static char community[64];
+
+//Compare two -1-terminated OIDs the SNMP way. Returns <0, 0 or >0.
+static int oid_cmp(const int *a, const int *b) {
+	int i=0;
+	while (a[i]>=0 && b[i]>=0) {
+		if (a[i]!=b[i]) return (a[i]<b[i])?-1:1;
+		i++;
+	}
+	if (a[i]<0 && b[i]<0) return 0;
+	return (a[i]<0)?-1:1;
+}
+
+//Write a tag plus a 2-byte long form length, to be filled in by patch_len later. Using the
+//long form everywhere means the header sizes don't depend on the contents.
+static int put_hdr(char *b, int tag) {
+	b[0]=tag;
+	b[1]=0x82;
+	b[2]=0;
+	b[3]=0;
+	return 4;
+}
+
+static void patch_len(char *hdr, int end_off, int hdr_off) {
+	int l=end_off-(hdr_off+4);
+	hdr[2]=l>>8;
+	hdr[3]=l;
+}
+
+//Minimal BER encoding of an unsigned 32-bit value.
+static int put_uint(char *b, int tag, uint32_t v) {
+	int nb=1;
+	while (nb<4 && (v>>(nb*8))!=0) nb++;
+	//Add a leading zero if the top bit is set, so it doesn't read as negative.
+	int pad=((v>>((nb-1)*8))&0x80)?1:0;
+	b[0]=tag;
+	b[1]=nb+pad;
+	int p=2;
+	if (pad) b[p++]=0;
+	for (int i=nb-1; i>=0; i--) b[p++]=v>>(i*8);
+	return p;
+}
+
+//Turn the request into an error response in place and send it back.
+static void send_error(char *buf, int len, const PduReq *req, int err, int idx, struct sockaddr_in *from) {
+	buf[req->pdu_offset]=(char)PRIM_GETRESPPDU;
+	//Keep the lengths, so nothing needs to move; leading zeroes are fine in BER.
+	memset(&buf[req->errstat_offset], 0, req->errstat_len-1);
+	buf[req->errstat_offset+req->errstat_len-1]=err;
+	memset(&buf[req->erridx_offset], 0, req->erridx_len-1);
+	buf[req->erridx_offset+req->erridx_len-1]=idx;
+	sendto(sockfd, buf, len, 0, (struct sockaddr*)from, sizeof(*from));
+}
+
+//Find the object for a GET (exact) or GETNEXT (first one after oid). Returns -1 if none.
+static int find_obj(const int *oid, int next) {
+	for (int i=0; i<NOBJS; i++) {
+		int c=oid_cmp(objs[i].oid, oid);
+		if (!next && c==0) return i;
+		if (next && c>0) return i;
+	}
+	return -1;
+}
+
+static void handle_req(char *buf, int len, struct sockaddr_in *from) {
+	static PduReq req;
+	static char resp[RESP_SIZE];
+	int r=pduParseReq(buf, len, &req);
+	if (r==0) return;
+	if (req.version>1) return; //v1 and v2c only
+	if (req.community_len!=strlen(community) || memcmp(req.community, community, req.community_len)!=0) return;
+	//Only answer requests. Responding to responses, traps or reports could make us ping-pong
+	//error responses with another agent, or with whatever a spoofed source points at.
+	int is_bulk=(req.pdu_type==PRIM_GETBULKPDU && req.version==1);
+	if (req.pdu_type!=PRIM_GETREQPDU && req.pdu_type!=PRIM_GETNEXTREQPDU &&
+			req.pdu_type!=PRIM_SETREQPDU && !is_bulk) return;
+	if (r==-1) {
+		send_error(buf, len, &req, ERR_TOOBIG, 0, from);
+		return;
+	}
+	int next;
+	if (req.pdu_type==PRIM_GETREQPDU) {
+		next=0;
+	} else if (req.pdu_type==PRIM_GETNEXTREQPDU || is_bulk) {
+		//Note: GETBULK is answered as a GETNEXT, i.e. with one repetition.
+		next=1;
+	} else {
+		//SET; everything here is read-only.
+		send_error(buf, len, &req, (req.version==0)?ERR_NOSUCHNAME:ERR_NOTWRITABLE, 1, from);
+		return;
+	}
+
+	//Response header, minus the lengths
+	int p=put_hdr(resp, PRIM_SEQ);
+	resp[p++]=PRIM_INT;
+	resp[p++]=1;
+	resp[p++]=req.version;
+	resp[p++]=PRIM_OCTSTR;
+	resp[p++]=req.community_len;
+	memcpy(&resp[p], req.community, req.community_len);
+	p+=req.community_len;
+	int pdu_off=p;
+	p+=put_hdr(&resp[p], PRIM_GETRESPPDU);
+	memcpy(&resp[p], req.reqid, req.reqid_len);
+	p+=req.reqid_len;
+	p+=put_uint(&resp[p], PRIM_INT, 0);
+	p+=put_uint(&resp[p], PRIM_INT, 0);
+	int vbl_off=p;
+	p+=put_hdr(&resp[p], PRIM_SEQ);
+
+	for (int i=0; i<req.nvb; i++) {
+		if (req.oid[i][0]==-1) {
+			send_error(buf, len, &req, ERR_GENERR, i+1, from);
+			return;
+		}
+		int o=find_obj(req.oid[i], next);
+		if (o==-1 && req.version==0) {
+			send_error(buf, len, &req, ERR_NOSUCHNAME, i+1, from);
+			return;
+		}
+		//Worst case for one varbind: header, OID, 7-byte value
+		if (p+2+PDU_REQ_OID_MAX*5+2+7>RESP_SIZE) {
+			send_error(buf, len, &req, ERR_TOOBIG, 0, from);
+			return;
+		}
+		int vb_start=p;
+		p+=2;
+		if (o>=0) {
+			memcpy(&resp[p], objs[o].oid_tlv, objs[o].oid_tlv_len);
+			p+=objs[o].oid_tlv_len;
+			p+=put_uint(&resp[p], objs[o].type, objs[o].get());
+		} else {
+			p+=pduEncodeOid(req.oid[i], &resp[p]);
+			resp[p++]=next?EXC_ENDOFMIBVIEW:EXC_NOSUCHOBJECT;
+			resp[p++]=0;
+		}
+		resp[vb_start]=PRIM_SEQ;
+		resp[vb_start+1]=p-(vb_start+2);
+	}
+	patch_len(&resp[vbl_off], p, vbl_off);
+	patch_len(&resp[pdu_off], p, pdu_off);
+	patch_len(&resp[0], p, 0);
+	sendto(sockfd, resp, p, 0, (struct sockaddr*)from, sizeof(*from));
+}
+
+static void snmpagent_task(void *arg) {
+	static char buf[1500];
+	while(1) {
+		struct sockaddr_in from;
+		socklen_t fromlen=sizeof(from);
+		int len=recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+		if (len<=0) {
+			vTaskDelay(pdMS_TO_TICKS(100));
+			continue;
+		}
+		handle_req(buf, len, &from);
+	}
+}
+
+int snmpagent_start(const char *comm) {
+	if (strlen(comm)==0 || strlen(comm)>=sizeof(community)) {
+		ESP_LOGI(TAG, "No (valid) agent community configured, not starting SNMP agent");
+		return 0;
+	}
+	strcpy(community, comm);
+	//Pre-encode the OIDs of all objects.
+	const int base[]={AGENT_MIB_BASE, -1};
+	for (int i=0; i<NOBJS; i++) {
+		int n=0;
+		while (base[n]>=0) {
+			objs[i].oid[n]=base[n];
+			n++;
+		}
+		objs[i].oid[n++]=objs[i].sub;
+		objs[i].oid[n++]=0;
+		objs[i].oid[n]=-1;
+		objs[i].oid_tlv_len=pduEncodeOid(objs[i].oid, objs[i].oid_tlv);
+	}
+
+	sockfd=socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd<0) {
+		perror("socket");
+		return 0;
+	}
+	struct sockaddr_in addr={
+		.sin_family=AF_INET,
+		.sin_port=htons(161),
+		.sin_addr.s_addr=htonl(INADDR_ANY)
+	};
+	if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr))!=0) {
+		perror("bind");
+		close(sockfd);
+		return 0;
+	}
+	//Low priority; the display matters more than answering an NMS quickly.
+	MEM_TASK(snmpagent_task, "snmpagent", 3072, NULL, 2);
+	return 1;
+}
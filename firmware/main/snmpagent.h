@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+Small SNMP agent, so the device itself can be monitored from an NMS. Answers GET, GETNEXT
+and GETBULK (v1 and v2c) on UDP port 161 for a private MIB. All objects are scalars
+(instance .0) under AGENT_MIB_BASE:
+
+ .1  hvMillivolts		Gauge32		Filtered HV feedback voltage, as seen on the ADC pin
+ .2  hvTargetMillivolts	Gauge32		HV regulation target, same units
+ .3  hvPwmDuty			Gauge32		Boost converter PWM value, 0-511
+ .4  posdetCount		Counter32	Position detector hits
+ .5  pollRequests		Counter32	SNMP requests sent to the monitored agent
+ .6  pollTimeouts		Counter32	...of which timed out
+ .7  pollErrors			Counter32	...of which got an unusable reply
+ .8  pollRttUs			Gauge32		Round trip time of the last reply, in us
+ .9  heapFree			Gauge32		Free heap, bytes
+ .10 heapMinFree		Gauge32		Lowest free heap since boot, bytes
+ .11 uptime				TimeTicks	Time since boot
+ .12 trapsReceived		Counter32	SNMP traps received
+*/
+
+//Note: this is not an IANA-registered enterprise number. Change it if it clashes with
+//something on your network.
+#define AGENT_MIB_BASE 1,3,6,1,4,1,58888,1
+
+//Start the agent. Requests with a community string other than the given one are ignored.
+int snmpagent_start(const char *community);
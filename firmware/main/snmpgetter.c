@@ -24,91 +24,292 @@
 #include "snmppdu.h"
 #include "snmpgetter.h"
 #include "esp_log.h"
+#include "membudget.h"
+#include "ratecalc.h"
+#include "samplelog.h"
+#include "ctrlock.h"
+#include "trafstats.h"
+#include "wifips.h"
+#include "rtostrace.h"
 
 static int sockfd;
+static TaskHandle_t task_handle;
 static QueueHandle_t dataq=NULL;
 static int req_stop=0;
 static char req_in[1024], req_out[1024];
 static int req_in_len, req_out_len;
+static int req_in_idoff, req_out_idoff; //offsets of the request ID values in the packets
+static char target[64];
+static snmpgetter_stats_t stats;
+static portMUX_TYPE stats_mux=portMUX_INITIALIZER_UNLOCKED;
+static int64_t ts_last_sample=0, sched_last_sample=0;
+static int64_t alive_until=0;	//if no poll succeeded by this time, the agent is gone
+static int cadence_changed=0;
 
 static const char *TAG="snmpgetter";
 
-static int64_t get_octets_from_resp(char *buf) {
-	PduField *p=binToPdu(buf, NULL);
-	PduField *c;
-	//Move to actual value
-	c=p->contents;		//SNMP version
-	if (c==NULL) return -1;
-	c=c->next;			//Comm str
-	if (c==NULL) return -1;
-	c=c->next;			//PDU
-	if (c==NULL) return -1;
-	c=c->contents;		//ReqID
-	if (c==NULL) return -1;
-	c=c->next;		//Error
-	if (c==NULL) return -1;
-	c=c->next;		//Error idx
-	if (c==NULL) return -1;
-	c=c->next;		//Varbind list
-	if (c==NULL) return -1;
-	c=c->contents;		//Varbind
-	if (c==NULL) return -1;
-	c=c->contents;		//OID
-	if (c==NULL) return -1;
-	c=c->next;			//Value
-	if (c==NULL) return -1;
-	//todo: this needs to support xx64 values
-	int64_t bytes=pduGetIntVal(c);
-	pduFree(p);
-	return bytes;
-}
-
-static int64_t req_oid(char *req, int len) {
+//Poll interval. The task keeps this cadence itself, so consumers don't need to add delays.
+//If the agent turns out to only update its counters every few seconds, ctrlock takes over
+//and times the polls around those updates instead.
+#define POLL_INTERVAL_MS 500
+
+/*
+Retransmission timeout, estimated like TCP does (RFC6298) from the RTTs of the replies. A
+lost request is resent with the same request ID after RTO, doubling RTO every time, up to
+MAX_RETRANSMITS times. On a LAN with 2ms replies, a lost packet then costs tens of ms.
+The minimum is a lot lower than TCP's 1s: we know we're talking to something nearby.
+*/
+#define RTO_INITIAL_US 1000000
+#define RTO_MIN_US 20000
+#define RTO_MAX_US 2000000
+#define RTO_GRANULARITY_US 1000 //FreeRTOS tick, which is what select() has
+#define MAX_RETRANSMITS 3
+static uint32_t srtt_us=0, rttvar_us=0, rto_us=RTO_INITIAL_US;
+
+/*
+Every request gets its own ID, so we can tell a reply to the current request from a late
+reply to an earlier one (and from garbage). IDs are kept in 0x40000000-0x7fffffff so they
+always encode as 4 positive bytes and can be patched into the prebuilt packets.
+*/
+#define REQID_BASE 0x40000000
+#define REQID_MASK 0x3fffffff
+#define REQID_LATE_WINDOW 64 //replies to this many previous requests count as 'late', not 'stray'
+static uint32_t next_reqid=REQID_BASE;
+
+static void rto_update(uint32_t rtt_us) {
+	if (srtt_us==0) {
+		srtt_us=rtt_us;
+		rttvar_us=rtt_us/2;
+	} else {
+		uint32_t err=(srtt_us>rtt_us)?srtt_us-rtt_us:rtt_us-srtt_us;
+		rttvar_us=(3*rttvar_us+err)/4;
+		srtt_us=(7*srtt_us+rtt_us)/8;
+	}
+	uint32_t var=4*rttvar_us;
+	if (var<RTO_GRANULARITY_US) var=RTO_GRANULARITY_US;
+	rto_us=srtt_us+var;
+	if (rto_us<RTO_MIN_US) rto_us=RTO_MIN_US;
+	if (rto_us>RTO_MAX_US) rto_us=RTO_MAX_US;
+}
+
+//Longest a poll (two requests) can take before req_oid gives up on it, at the current RTO.
+static int64_t poll_budget_us() {
+	int64_t t=0, r=rto_us;
+	for (int i=0; i<=MAX_RETRANSMITS; i++) {
+		t+=r;
+		r*=2;
+		if (r>RTO_MAX_US) r=RTO_MAX_US;
+	}
+	return 2*t;
+}
+
+static void rto_backoff() {
+	rto_us*=2;
+	if (rto_us>RTO_MAX_US) rto_us=RTO_MAX_US;
+}
+
+static void stats_add_rtt(uint32_t rtt_us) {
+	int b=0;
+	while (b<SNMPGETTER_RTT_BUCKETS-1 && rtt_us>=(256U<<b)) b++;
+	portENTER_CRITICAL(&stats_mux);
+	stats.rtt_last_us=rtt_us;
+	if (stats.rtt_min_us==0 || rtt_us<stats.rtt_min_us) stats.rtt_min_us=rtt_us;
+	if (rtt_us>stats.rtt_max_us) stats.rtt_max_us=rtt_us;
+	stats.rtt_sum_us+=rtt_us;
+	stats.rtt_samples++;
+	stats.rtt_hist[b]++;
+	portEXIT_CRITICAL(&stats_mux);
+	wifips_add_rtt(rtt_us);
+}
+
+static void stats_inc(uint32_t *ctr) {
+	portENTER_CRITICAL(&stats_mux);
+	(*ctr)++;
+	portEXIT_CRITICAL(&stats_mux);
+}
+
+/*
+Track the time between successful samples. Jitter is how far that is off from the time
+between the deadlines the polls were scheduled for; once ctrlock times the polls around
+the agent updates, the interval is seconds and not constant, so comparing against a fixed
+number would make it meaningless. Polls without a deadline (snmpgetter_poll_now) count as
+scheduled for when they happened.
+*/
+static void stats_add_sample(int64_t ts, int64_t sched) {
+	if (ts_last_sample!=0) {
+		uint32_t iv=ts-ts_last_sample;
+		uint32_t sched_iv=sched-sched_last_sample;
+		int32_t dev=(int32_t)iv-(int32_t)sched_iv;
+		if (dev<0) dev=-dev;
+		portENTER_CRITICAL(&stats_mux);
+		stats.intervals++;
+		stats.interval_last_us=iv;
+		stats.interval_sched_us=sched_iv;
+		//Running averages, same idea as the RFC3550 jitter estimator. These start over when
+		//the cadence changes, so the old one doesn't linger in the averages.
+		if (stats.intervals==1 || cadence_changed) {
+			stats.interval_avg_us=iv;
+			stats.interval_max_us=iv;
+			stats.jitter_us=dev;
+			cadence_changed=0;
+		} else {
+			if (iv>stats.interval_max_us) stats.interval_max_us=iv;
+			stats.interval_avg_us+=((int32_t)iv-(int32_t)stats.interval_avg_us)/8;
+			stats.jitter_us+=(dev-(int32_t)stats.jitter_us)/16;
+		}
+		portEXIT_CRITICAL(&stats_mux);
+	}
+	ts_last_sample=ts;
+	sched_last_sample=sched;
+}
+
+static void stats_ctrlock(const ctrlock_t *cl, int use) {
+	int64_t period, window;
+	int locked=ctrlock_locked(cl, &period, &window);
+	portENTER_CRITICAL(&stats_mux);
+	//Polls go from a fixed cadence to following the updates when a period and phase are
+	//known (window!=0), and get tighter once locked.
+	if (locked!=stats.ctr_locked || (window!=0)!=(stats.ctr_window_us!=0)) {
+		stats.cadence_changes++;
+		cadence_changed=1;
+	}
+	if (!use) stats.aliased++;
+	stats.ctr_period_us=period;
+	stats.ctr_window_us=window;
+	stats.ctr_locked=locked;
+	portEXIT_CRITICAL(&stats_mux);
+}
+
+//Sends the request and waits for the reply, retransmitting if needed. Returns the counter
+//value, or -1 on error.
+static int64_t req_oid(char *req, int len, int idoff) {
+	uint32_t id=next_reqid;
+	next_reqid=REQID_BASE|((next_reqid+1)&REQID_MASK);
+	req[idoff]=id>>24;
+	req[idoff+1]=id>>16;
+	req[idoff+2]=id>>8;
+	req[idoff+3]=id;
+	int retransmits=0;
+	int64_t ts_sent=esp_timer_get_time();
 	write(sockfd, req, len);
-	fd_set set;
-	FD_ZERO(&set);
-	FD_SET(sockfd, &set);
-	struct timeval tv={
-		.tv_sec=1
-	};
-	int n=select(sockfd+1, &set, NULL, NULL, &tv);
-	if (n==1) {
+	stats_inc(&stats.requests);
+	while(1) {
+		int64_t left_us=(ts_sent+rto_us)-esp_timer_get_time();
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(sockfd, &set);
+		struct timeval tv={
+			.tv_sec=left_us/1000000,
+			.tv_usec=left_us%1000000
+		};
+		int n=(left_us>0)?select(sockfd+1, &set, NULL, NULL, &tv):0;
+		if (n!=1) {
+			//timeout or some error
+			rto_backoff();
+			if (retransmits==MAX_RETRANSMITS) {
+				ESP_LOGI(TAG, "timeout waiting for reply");
+				stats_inc(&stats.timeouts);
+				return -1;
+			}
+			//Same request, same ID, so a late reply to the original still counts.
+			retransmits++;
+			stats_inc(&stats.retransmits);
+			ts_sent=esp_timer_get_time();
+			write(sockfd, req, len);
+			continue;
+		}
 		//got data
 		char buff[1024];
-		int len=read(sockfd, buff, 1024);
-		return get_octets_from_resp(buff);
-	} else {
-		//timeout or some error
-		ESP_LOGI(TAG, "timeout waiting for reply");
-		return -1;
+		int rlen=read(sockfd, buff, 1024);
+		int reqid, errstat;
+		uint64_t bytes;
+		//Note: this doesn't allocate anything, so polling doesn't churn the heap.
+		if (rlen<=0 || !pduParseIntResp(buff, rlen, &reqid, &errstat, &bytes)) {
+			stats_inc(&stats.decode_fail);
+			continue;
+		}
+		if (reqid!=id) {
+			//Not for us. Keep waiting for the real reply.
+			uint32_t age=(id-reqid)&REQID_MASK;
+			if ((reqid&~REQID_MASK)==REQID_BASE && age<REQID_LATE_WINDOW) {
+				stats_inc(&stats.late);
+			} else {
+				stats_inc(&stats.stray);
+			}
+			continue;
+		}
+		stats_inc(&stats.replies);
+		//Karn: if we retransmitted, we don't know which send this is a reply to, so the
+		//RTT is meaningless.
+		if (retransmits==0) {
+			uint32_t rtt=esp_timer_get_time()-ts_sent;
+			rto_update(rtt);
+			stats_add_rtt(rtt);
+		}
+		if (errstat!=0) {
+			stats_inc(&stats.errors);
+			return -1;
+		}
+		return bytes;
 	}
 }
 
 static void snmpgetter_task(void *arg) {
 	ESP_LOGI(TAG, "task started");
 	snmpgetter_bw_t bw={0};
-	int64_t in_last=0, out_last=0, ts_last=0;
+	ratecalc_t rc={0};
+	ctrlock_t cl={0};
+	int64_t next_poll=esp_timer_get_time();
+	portENTER_CRITICAL(&stats_mux);
+	alive_until=0;
+	portEXIT_CRITICAL(&stats_mux);
 	while(!req_stop) {
+		//Absolute deadline: a slow reply doesn't push back all following polls. A
+		//notification (snmpgetter_poll_now) gets us an extra poll without moving the deadline.
+		int64_t left_us=next_poll-esp_timer_get_time();
+		int out_of_cycle=0;
+		if (left_us>0) out_of_cycle=ulTaskNotifyTake(pdTRUE, (left_us+portTICK_PERIOD_MS*1000-1)/(portTICK_PERIOD_MS*1000));
+		RTOSTRACE_BEGIN(RTOSTRACE_MARK_SNMP_POLL);
 		int64_t ts_at_req=esp_timer_get_time();
-		int64_t in_bytes=req_oid(req_in, req_in_len);
-		int64_t out_bytes=req_oid(req_out, req_out_len);
-		if (in_bytes!=-1 && out_bytes!=-1) {
-			int64_t time_ms=(ts_at_req-ts_last)/1000;
-			int64_t diff_in=in_bytes-in_last;
-			int64_t diff_out=out_bytes-out_last;
-			//Fix rollover. Note that this assumes a 32-bit response from in_bytes/out_bytes. Given we
-			//don't support 64-bit things yet, this will always be the case.
-			if (diff_in<0) diff_in+=(1ULL<<32);
-			if (diff_out<0) diff_out+=(1ULL<<32);
-			bw.bps_in=(diff_in*1000ULL)/time_ms;
-			bw.bps_out=(diff_out*1000ULL)/time_ms;
-			if (ts_last!=0) xQueueSend(dataq, &bw, portMAX_DELAY);
-			ts_last=ts_at_req;
-			in_last=in_bytes;
-			out_last=out_bytes;
+		int64_t sched=out_of_cycle?ts_at_req:next_poll;
+		int64_t in_bytes=req_oid(req_in, req_in_len, req_in_idoff);
+		int64_t ts_in_done=esp_timer_get_time();
+		int64_t out_bytes=req_oid(req_out, req_out_len, req_out_idoff);
+		RTOSTRACE_END(RTOSTRACE_MARK_SNMP_POLL);
+		int ok=(in_bytes!=-1 && out_bytes!=-1);
+		int use=ok?ctrlock_sample(&cl, ts_at_req, in_bytes, out_bytes):0;
+		slog_rec_t rec={
+			.ts_us=ts_at_req,
+			.type=SLOG_REC_SAMPLE,
+			.flags=((in_bytes!=-1)?SLOG_FLAG_IN_OK:0)|((out_bytes!=-1)?SLOG_FLAG_OUT_OK:0)|((ok && !use)?SLOG_FLAG_ALIASED:0),
+			.rtt_in=samplelog_rtt(ts_in_done-ts_at_req),
+			.rtt_out=samplelog_rtt(esp_timer_get_time()-ts_in_done),
+			.a=in_bytes,
+			.b=out_bytes
+		};
+		samplelog_add(&rec);
+		if (ok) {
+			stats_add_sample(ts_at_req, sched);
+			stats_ctrlock(&cl, use);
+			if (use) {
+				int have_bw=ratecalc_update(&rc, ts_at_req, in_bytes, out_bytes, &bw);
+				//Newest sample wins; a slow consumer should not stall the poll cadence.
+				if (have_bw) xQueueOverwrite(dataq, &bw);
+				trafstats_add(in_bytes, out_bytes, have_bw?&bw:NULL);
+			}
+		}
+		if (!out_of_cycle) next_poll=ctrlock_next_poll(&cl, esp_timer_get_time(), POLL_INTERVAL_MS*1000);
+		if (ok) {
+			//Once locked, polls can be up to a counter period apart. Allow one of them to
+			//get lost entirely before calling the agent gone.
+			int64_t until=next_poll+(next_poll-ts_at_req)+poll_budget_us();
+			portENTER_CRITICAL(&stats_mux);
+			alive_until=until;
+			portEXIT_CRITICAL(&stats_mux);
 		}
 	}
 	close(sockfd);
+	task_handle=NULL;
 	req_stop=0;
 	ESP_LOGI(TAG, "task finished");
 	vTaskDelete(NULL);
@@ -118,6 +319,13 @@ int snmpgetter_get_bw(snmpgetter_bw_t *bw, int timeout) {
 	return xQueueReceive(dataq, bw, timeout);
 }
 
+int snmpgetter_alive() {
+	portENTER_CRITICAL(&stats_mux);
+	int64_t until=alive_until;
+	portEXIT_CRITICAL(&stats_mux);
+	return (esp_timer_get_time()<until);
+}
+
 static int gen_pdu_packet_for(const char *comstr, const char *oid, char *pkt) {
 	int myOid[64];
 	pduAscToOid(oid, myOid);
@@ -126,7 +334,7 @@ static int gen_pdu_packet_for(const char *comstr, const char *oid, char *pkt) {
 	pduAddToSequence(req, pduNewInt(1)); //SNMP version
 	pduAddToSequence(req, pduNewOctetString(comstr)); //SNMP community
 	PduField *getreq=pduNewGetReqPdu();
-	pduAddToSequence(getreq, pduNewInt(1)); //Req ID
+	pduAddToSequence(getreq, pduNewInt(REQID_BASE)); //Req ID, patched for every request
 	pduAddToSequence(getreq, pduNewInt(0)); //Error
 	pduAddToSequence(getreq, pduNewInt(0)); //Error idx
 	PduField *vbl=pduNewSequence();
@@ -144,6 +352,14 @@ static int gen_pdu_packet_for(const char *comstr, const char *oid, char *pkt) {
 	return packet_len;
 }
 
+//Find the offset of the 4-byte request ID value in a request we generated.
+static int find_reqid(char *pkt, int len) {
+	static PduReq req; //too large for the stack
+	if (pduParseReq(pkt, len, &req)!=1) return -1;
+	if (req.reqid_len!=6) return -1;
+	return (req.reqid+2)-pkt;
+}
+
 int snmpgetter_start(const char *host, int port, char *comstr, char *oid_in, char *oid_out) {
 	struct hostent *he;
 	he = gethostbyname(host);
@@ -178,12 +394,55 @@ int snmpgetter_start(const char *host, int port, char *comstr, char *oid_in, cha
 	
 	req_in_len=gen_pdu_packet_for(comstr, oid_in, req_in);
 	req_out_len=gen_pdu_packet_for(comstr, oid_out, req_out);
+	req_in_idoff=find_reqid(req_in, req_in_len);
+	req_out_idoff=find_reqid(req_out, req_out_len);
+	if (req_in_idoff<0 || req_out_idoff<0) {
+		ESP_LOGE(TAG, "Can't find request ID in generated packet");
+		close(sockfd);
+		return 0;
+	}
+	strncpy(target, host, sizeof(target)-1);
 	
-	if (!dataq) dataq=xQueueCreate(1, sizeof(snmpgetter_bw_t));
-	xTaskCreate(snmpgetter_task, "snmpget", 8192, NULL, 5, NULL);
+	if (!dataq) {
+		dataq=MEM_QUEUE(1, sizeof(snmpgetter_bw_t));
+		rtostrace_watch_queue(dataq, "dataq");
+	}
+#if CONFIG_DEKA_STATIC_ALLOC
+	static int task_created=0;
+	if (task_created) {
+		//Static tasks can't safely be re-created from the same buffers.
+		ESP_LOGE(TAG, "snmpgetter already started once");
+		return 0;
+	}
+	task_created=1;
+#endif
+	task_handle=MEM_TASK(snmpgetter_task, "snmpget", 8192, NULL, 5);
 	return 1;
 }
 
+void snmpgetter_get_stats(snmpgetter_stats_t *st) {
+	portENTER_CRITICAL(&stats_mux);
+	*st=stats;
+	portEXIT_CRITICAL(&stats_mux);
+	st->srtt_us=srtt_us;
+	st->rttvar_us=rttvar_us;
+	st->rto_us=rto_us;
+}
+
+void snmpgetter_reset_stats() {
+	portENTER_CRITICAL(&stats_mux);
+	memset(&stats, 0, sizeof(stats));
+	portEXIT_CRITICAL(&stats_mux);
+}
+
+const char *snmpgetter_get_target() {
+	return target;
+}
+
+void snmpgetter_poll_now() {
+	if (task_handle) xTaskNotifyGive(task_handle);
+}
+
 void snmpgetter_stop() {
 	//kinda hacky but works
 	req_stop=1;
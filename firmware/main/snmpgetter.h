@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 
 //note: bps here means *bytes* per second
 typedef struct {
@@ -8,7 +9,58 @@ typedef struct {
 
 int snmpgetter_get_bw(snmpgetter_bw_t *bw, int timeout);
 
+//Returns 1 if the agent is answering. Unlike the rate from snmpgetter_get_bw, which only
+//comes in once per counter update, this stays set for as long as the polls succeed.
+int snmpgetter_alive();
+
+//RTT histogram: bucket n counts replies with an RTT below 256<<n us (and above the previous
+//bucket); the last bucket catches everything slower.
+#define SNMPGETTER_RTT_BUCKETS 14
+
+typedef struct {
+	uint32_t requests;		//Requests sent
+	uint32_t replies;		//Replies to the request we were waiting for
+	uint32_t timeouts;		//Requests that didn't get a reply, even after retransmitting
+	uint32_t retransmits;	//Requests that were resent because the reply took longer than the RTO
+	uint32_t errors;		//Replies with an error status
+	uint32_t decode_fail;	//Packets that couldn't be decoded
+	uint32_t late;			//Replies to a request that already timed out
+	uint32_t stray;			//Replies with a request ID we didn't send recently
+	uint32_t rtt_last_us;	//Round trip time of the last reply to a request that wasn't resent
+	uint32_t rtt_min_us;
+	uint32_t rtt_max_us;
+	uint32_t rtt_samples;	//Amount of RTTs measured (i.e. replies without retransmits)
+	uint64_t rtt_sum_us;	//divide by rtt_samples for the average
+	uint32_t rtt_hist[SNMPGETTER_RTT_BUCKETS];
+	uint32_t intervals;			//Amount of intervals between successful samples measured
+	uint32_t interval_last_us;	//Time between the last two successful samples
+	uint32_t interval_sched_us;	//Time between the deadlines they were scheduled for
+	uint32_t interval_avg_us;	//Running average of the actual interval, since the last cadence change
+	uint32_t interval_max_us;	//...and the longest one
+	uint32_t jitter_us;			//Running average of the deviation from the scheduled interval
+	uint32_t cadence_changes;	//Times ctrlock changed how polls are scheduled
+	uint32_t srtt_us;			//Smoothed RTT, RTT variation and resulting retransmission timeout
+	uint32_t rttvar_us;
+	uint32_t rto_us;
+	uint32_t aliased;			//Samples skipped because the agent hadn't updated its counters yet
+	uint32_t ctr_period_us;		//Agent counter update period, 0 if they update live
+	uint32_t ctr_window_us;		//How well we know when the next update happens
+	uint32_t ctr_locked;		//1 if polls are timed around the agent updates
+} snmpgetter_stats_t;
+
+//Get counters on how the polling of the target goes.
+void snmpgetter_get_stats(snmpgetter_stats_t *st);
+
+//Zero all counters.
+void snmpgetter_reset_stats();
+
+//Hostname of the agent we're polling.
+const char *snmpgetter_get_target();
+
 int snmpgetter_start(const char *host, int port, char *comstr, char *oid_in, char *oid_out);
 void snmpgetter_stop();
 
+//Poll the counters right now instead of waiting for the next interval.
+void snmpgetter_poll_now();
+
 
@@ -385,3 +385,277 @@ void pduFree(PduField *f) {
 	free(f);
 }
 
+
+//Decode one TLV header. Returns a pointer to the contents and fills in type and content
+//length, or returns NULL if the TLV doesn't fit in the avail bytes at b. Unlike decodeLen, 
+//this handles the BER long length form.
+static const unsigned char *berTlv(const unsigned char *b, int avail, int *type, int *len) {
+	if (avail<2) return NULL;
+	*type=b[0];
+	int p=1;
+	int l=b[p++];
+	if (l&0x80) {
+		int nb=l&0x7f;
+		if (nb==0 || nb>2 || avail<p+nb) return NULL;
+		l=0;
+		while (nb--) l=(l<<8)|b[p++];
+	}
+	if (l>avail-p) return NULL;
+	*len=l;
+	return &b[p];
+}
+
+static uint64_t berUint(const unsigned char *b, int len) {
+	uint64_t r=0;
+	for (int i=0; i<len; i++) r=(r<<8)|b[i];
+	return r;
+}
+
+int pduParseIntResp(const char *buff, int len, int *reqid, int *errstat, uint64_t *val) {
+	const unsigned char *b=(const unsigned char*)buff;
+	const unsigned char *end=b+len;
+	int t, l;
+	//Outer sequence
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	//Version, community
+	const unsigned char *c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT) return 0;
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_OCTSTR) return 0;
+	b=c+l;
+	//PDU
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_GETRESPPDU) return 0;
+	end=b+l;
+	//Request ID, error, error idx
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT || l<1 || l>4) return 0;
+	*reqid=berUint(c, l);
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT || l<1 || l>4) return 0;
+	*errstat=berUint(c, l);
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT) return 0;
+	b=c+l;
+	//Varbind list, varbind
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	//OID, value
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_OID) return 0;
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c) return 0;
+	if (t!=PRIM_INT && t!=PRIM_CTR32 && t!=PRIM_GAUGE32 && t!=PRIM_CTR64) return 0;
+	if (l<1 || l>9) return 0;
+	*val=berUint(c, l);
+	return 1;
+}
+
+//Decode the contents of an OID TLV into oid, -1-terminated. Returns the amount of
+//sub-identifiers, or -1 if it doesn't fit or is malformed.
+static int berOid(const unsigned char *b, int len, int *oid, int max) {
+	if (len<1 || max<3) return -1;
+	int n=0;
+	uint32_t v=0;
+	for (int i=0; i<len; i++) {
+		v=(v<<7)|(b[i]&0x7f);
+		if (b[i]&0x80) continue;
+		if (n==0) {
+			//First byte holds the first two sub-identifiers
+			oid[n++]=(v<80)?v/40:2;
+			oid[n++]=(v<80)?v%40:v-80;
+		} else {
+			if (n>=max-1) return -1;
+			oid[n++]=v;
+		}
+		v=0;
+	}
+	if (b[len-1]&0x80) return -1;
+	oid[n]=-1;
+	return n;
+}
+
+static int oidHasPrefix(const int *oid, const int *prefix) {
+	for (int i=0; prefix[i]>=0; i++) {
+		if (oid[i]!=prefix[i]) return 0;
+	}
+	return 1;
+}
+
+int pduParseTrap(const char *buff, int len, PduTrap *trap) {
+	static const int snmpTrapOid[]={1,3,6,1,6,3,1,1,4,1,0,-1};
+	static const int snmpTraps[]={1,3,6,1,6,3,1,1,5,-1};
+	static const int ifEntry[]={1,3,6,1,2,1,2,2,1,-1};
+	const unsigned char *start=(const unsigned char*)buff;
+	const unsigned char *b=start;
+	const unsigned char *end=b+len;
+	int t, l;
+	int oid[PDU_TRAP_OID_MAX];
+	trap->oid[0]=-1;
+	trap->if_index=-1;
+	//Outer sequence, version, community
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	const unsigned char *c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT) return 0;
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_OCTSTR) return 0;
+	b=c+l;
+	//PDU
+	trap->pdu_offset=b-start;
+	b=berTlv(b, end-b, &t, &l);
+	if (!b) return 0;
+	trap->pdu_type=t;
+	end=b+l;
+	if (t==PRIM_TRAPV1PDU) {
+		//enterprise, agent-addr, generic-trap, specific-trap, time-stamp
+		c=berTlv(b, end-b, &t, &l);
+		if (!c || t!=PRIM_OID) return 0;
+		int n=berOid(c, l, trap->oid, PDU_TRAP_OID_MAX-2);
+		if (n<0) return 0;
+		b=c+l;
+		c=berTlv(b, end-b, &t, &l);
+		if (!c || t!=PRIM_IPADDR) return 0;
+		b=c+l;
+		c=berTlv(b, end-b, &t, &l);
+		if (!c || t!=PRIM_INT || l<1 || l>4) return 0;
+		int generic=berUint(c, l);
+		b=c+l;
+		c=berTlv(b, end-b, &t, &l);
+		if (!c || t!=PRIM_INT || l<1 || l>4) return 0;
+		int specific=berUint(c, l);
+		b=c+l;
+		c=berTlv(b, end-b, &t, &l);
+		if (!c || t!=PRIM_TIMETICKS) return 0;
+		b=c+l;
+		if (generic!=6) {
+			//Generic traps map to snmpTraps.(generic+1)
+			memcpy(trap->oid, snmpTraps, sizeof(snmpTraps));
+			trap->oid[9]=generic+1;
+			trap->oid[10]=-1;
+		} else {
+			//Enterprise-specific traps map to enterprise.0.specific
+			trap->oid[n++]=0;
+			trap->oid[n++]=specific;
+			trap->oid[n]=-1;
+		}
+	} else if (t==PRIM_TRAPV2PDU || t==PRIM_INFORMPDU) {
+		//Request ID, error, error idx
+		for (int i=0; i<3; i++) {
+			c=berTlv(b, end-b, &t, &l);
+			if (!c || t!=PRIM_INT) return 0;
+			b=c+l;
+		}
+	} else {
+		return 0;
+	}
+	//Varbind list
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	while (b<end) {
+		const unsigned char *vb=berTlv(b, end-b, &t, &l);
+		if (!vb || t!=PRIM_SEQ) return 0;
+		const unsigned char *vbend=vb+l;
+		b=vbend;
+		c=berTlv(vb, vbend-vb, &t, &l);
+		if (!c || t!=PRIM_OID) return 0;
+		int n=berOid(c, l, oid, PDU_TRAP_OID_MAX);
+		if (n<0) continue; //too long to be interesting
+		vb=c+l;
+		int vt, vl;
+		c=berTlv(vb, vbend-vb, &vt, &vl);
+		if (!c) return 0;
+		if (oidHasPrefix(oid, snmpTrapOid) && oid[11]==-1 && vt==PRIM_OID) {
+			if (berOid(c, vl, trap->oid, PDU_TRAP_OID_MAX)<0) return 0;
+		} else if (oidHasPrefix(oid, ifEntry) && n==11) {
+			//ifTable column; the instance is the ifIndex
+			if (trap->if_index==-1) trap->if_index=oid[10];
+		}
+	}
+	if (trap->oid[0]==-1) return 0;
+	return 1;
+}
+
+int pduParseReq(const char *buff, int len, PduReq *req) {
+	const unsigned char *start=(const unsigned char*)buff;
+	const unsigned char *b=start;
+	const unsigned char *end=b+len;
+	int t, l;
+	//Outer sequence, version, community
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	const unsigned char *c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT || l!=1) return 0;
+	req->version=c[0];
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_OCTSTR) return 0;
+	req->community=(const char*)c;
+	req->community_len=l;
+	b=c+l;
+	//PDU
+	req->pdu_offset=b-start;
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || (t&0xE0)!=0xA0) return 0;
+	req->pdu_type=t;
+	end=b+l;
+	//Request ID, error, error idx
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT || l<1 || l>5) return 0;
+	req->reqid=(const char*)b;
+	req->reqid_len=(c+l)-b;
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT || l<1 || l>4) return 0;
+	req->errstat_offset=c-start;
+	req->errstat_len=l;
+	b=c+l;
+	c=berTlv(b, end-b, &t, &l);
+	if (!c || t!=PRIM_INT || l<1 || l>4) return 0;
+	req->erridx_offset=c-start;
+	req->erridx_len=l;
+	b=c+l;
+	//Varbind list
+	b=berTlv(b, end-b, &t, &l);
+	if (!b || t!=PRIM_SEQ) return 0;
+	end=b+l;
+	req->nvb=0;
+	while (b<end) {
+		const unsigned char *vb=berTlv(b, end-b, &t, &l);
+		if (!vb || t!=PRIM_SEQ) return 0;
+		b=vb+l;
+		if (req->nvb==PDU_REQ_MAX_VB) return -1;
+		c=berTlv(vb, b-vb, &t, &l);
+		if (!c || t!=PRIM_OID) return 0;
+		int *oid=req->oid[req->nvb++];
+		if (berOid(c, l, oid, PDU_REQ_OID_MAX)<0) oid[0]=-1;
+	}
+	return 1;
+}
+
+int pduEncodeOid(const int *oid, char *b) {
+	int p=2;
+	b[0]=PRIM_OID;
+	if (oid[0]<0 || oid[1]<0) {
+		b[1]=0;
+		return 2;
+	}
+	p+=encodeLen(&b[p], oid[0]*40+oid[1]);
+	for (int i=2; oid[i]>=0; i++) p+=encodeLen(&b[p], oid[i]);
+	b[1]=p-2;
+	return p;
+}
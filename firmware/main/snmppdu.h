@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 
 //This is old code. I should have documented all this.
 
@@ -7,11 +8,19 @@
 #define PRIM_NULL 0x05
 #define PRIM_OID 0x06
 #define PRIM_SEQ 0x30
+#define PRIM_IPADDR 0x40
 #define PRIM_CTR32 0x41
 #define PRIM_GAUGE32 0x42
+#define PRIM_TIMETICKS 0x43
+#define PRIM_CTR64 0x46
 #define PRIM_GETREQPDU 0xA0
+#define PRIM_GETNEXTREQPDU 0xA1
 #define PRIM_GETRESPPDU 0xA2
 #define PRIM_SETREQPDU 0xA3
+#define PRIM_TRAPV1PDU 0xA4
+#define PRIM_GETBULKPDU 0xA5
+#define PRIM_INFORMPDU 0xA6
+#define PRIM_TRAPV2PDU 0xA7
 
 //#define DEBUG
 typedef struct PduField PduField;
@@ -48,3 +57,49 @@ int pduToBin(PduField *f, char *b);
 PduField *binToPdu(char *b, int *endpos);
 void pduFree(PduField *f);
 
+//Non-allocating decoder for the common case of a GetResponse with one integer varbind.
+//Checks the packet structure against len. Returns 1 and fills in the request ID, error 
+//status and value (Integer, Counter32, Gauge32 or Counter64) on success, 0 if the packet
+//is malformed or the value isn't an integer.
+int pduParseIntResp(const char *b, int len, int *reqid, int *errstat, uint64_t *val);
+
+
+#define PDU_TRAP_OID_MAX 32
+
+typedef struct {
+	int pdu_type;		//PRIM_TRAPV1PDU, PRIM_TRAPV2PDU or PRIM_INFORMPDU
+	int pdu_offset;		//Offset of the PDU tag in the packet
+	int oid[PDU_TRAP_OID_MAX];	//snmpTrapOID, -1-terminated. SNMPv1 traps are translated as per RFC3584.
+	int if_index;		//Interface the trap is about (from the ifTable varbinds), -1 if none
+} PduTrap;
+
+//Non-allocating decoder for SNMPv1 traps, SNMPv2 traps and informs. Returns 1 and fills in
+//the trap on success, 0 if the packet is malformed or isn't a trap.
+int pduParseTrap(const char *b, int len, PduTrap *trap);
+
+#define PDU_REQ_MAX_VB 8
+#define PDU_REQ_OID_MAX 24
+
+typedef struct {
+	int version;
+	const char *community;
+	int community_len;
+	int pdu_type;		//PRIM_GETREQPDU, PRIM_GETNEXTREQPDU, ...
+	int pdu_offset;		//Offset of the PDU tag in the packet
+	const char *reqid;	//Raw request ID TLV, so it can be copied into a response as-is
+	int reqid_len;
+	int errstat_offset;	//Offsets and lengths of the error status and index values; for a
+	int errstat_len;	//GETBULK, these are non-repeaters and max-repetitions and can be
+	int erridx_offset;	//longer than one byte.
+	int erridx_len;
+	int nvb;
+	int oid[PDU_REQ_MAX_VB][PDU_REQ_OID_MAX];	//Varbind OIDs, -1-terminated. oid[x][0]==-1 if too long.
+} PduReq;
+
+//Non-allocating decoder for requests to an agent. Returns 1 and fills in req on success, 0
+//if the packet is malformed, -1 if it is valid but has more than PDU_REQ_MAX_VB varbinds.
+int pduParseReq(const char *b, int len, PduReq *req);
+
+//Write an OID TLV for the -1-terminated oid into b. Returns the amount of bytes written. Does
+//not allocate. b needs to be large enough; 5 bytes per component is always enough.
+int pduEncodeOid(const int *oid, char *b);
@@ -0,0 +1,149 @@
+// Receiver for SNMP traps and informs.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "snmppdu.h"
+#include "snmptrap.h"
+#include "snmpgetter.h"
+#include "dekatron.h"
+#include "membudget.h"
+
+static const char *TAG="snmptrap";
+
+#define MAX_TRAP_OIDS 8
+
+static const int oid_link_down[]={1,3,6,1,6,3,1,1,5,3,-1};
+static const int oid_link_up[]={1,3,6,1,6,3,1,1,5,4,-1};
+
+static int sockfd;
+static int watch_if_index;
+static int trap_oids[MAX_TRAP_OIDS][PDU_TRAP_OID_MAX];
+static int trap_oid_ct=0;
+static int traps_received=0, traps_shown=0;
+
+//Returns 1 if oid starts with (or equals) prefix.
+static int oid_match(const int *oid, const int *prefix) {
+	for (int i=0; prefix[i]>=0; i++) {
+		if (oid[i]!=prefix[i]) return 0;
+	}
+	return 1;
+}
+
+//Show the event: kill whatever is on the tube, blink the event, and get a new
+//sample in right away so the spin afterwards reflects the new situation.
+static void show_event(int c) {
+	deka_flush_anims();
+	deka_queue_anim(DEKA_ANIM_TYPE_BLINK, c, 150*1000, 3000);
+	snmpgetter_poll_now();
+	traps_shown++;
+}
+
+static void handle_trap(const PduTrap *trap) {
+	if (oid_match(trap->oid, oid_link_down) || oid_match(trap->oid, oid_link_up)) {
+		int up=oid_match(trap->oid, oid_link_up);
+		ESP_LOGI(TAG, "link%s trap for ifIndex %d", up?"Up":"Down", trap->if_index);
+		if (trap->if_index==watch_if_index) show_event(up?'1':'0');
+		return;
+	}
+	for (int i=0; i<trap_oid_ct; i++) {
+		if (oid_match(trap->oid, trap_oids[i])) {
+			ESP_LOGI(TAG, "trap matches configured OID %d", i);
+			show_event('8');
+			return;
+		}
+	}
+}
+
+static void snmptrap_task(void *arg) {
+	//Note: static so it doesn't eat into the task stack.
+	static char buf[1500];
+	while(1) {
+		struct sockaddr_in from;
+		socklen_t fromlen=sizeof(from);
+		int len=recvfrom(sockfd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+		if (len<=0) {
+			vTaskDelay(pdMS_TO_TICKS(100));
+			continue;
+		}
+		PduTrap trap;
+		if (!pduParseTrap(buf, len, &trap)) {
+			ESP_LOGD(TAG, "ignoring non-trap packet of %d bytes", len);
+			continue;
+		}
+		traps_received++;
+		if (trap.pdu_type==PRIM_INFORMPDU) {
+			//The Response to an inform is the inform itself (same request ID and
+			//varbinds, error status 0) with a different PDU tag. Acknowledge it first
+			//so the sender doesn't retransmit.
+			buf[trap.pdu_offset]=(char)PRIM_GETRESPPDU;
+			sendto(sockfd, buf, len, 0, (struct sockaddr*)&from, fromlen);
+		}
+		handle_trap(&trap);
+	}
+}
+
+//Parse a comma-separated list of OIDs.
+static void parse_trap_oids(const char *list) {
+	char oid[128];
+	trap_oid_ct=0;
+	while (*list && trap_oid_ct<MAX_TRAP_OIDS) {
+		int l=strcspn(list, ", ");
+		if (l>0 && l<sizeof(oid)) {
+			memcpy(oid, list, l);
+			oid[l]=0;
+			//pduAscToOid doesn't do bounds checking, so check the amount of components first.
+			int dots=0;
+			for (int i=0; i<l; i++) if (oid[i]=='.') dots++;
+			if (dots<PDU_TRAP_OID_MAX-2) {
+				pduAscToOid(oid, trap_oids[trap_oid_ct]);
+				trap_oid_ct++;
+			}
+		}
+		list+=l;
+		while (*list==',' || *list==' ') list++;
+	}
+}
+
+int snmptrap_start(int if_index, const char *oids) {
+	watch_if_index=if_index;
+	parse_trap_oids(oids);
+	ESP_LOGI(TAG, "Watching ifIndex %d, plus %d configured trap OIDs", if_index, trap_oid_ct);
+
+	sockfd=socket(AF_INET, SOCK_DGRAM, 0);
+	if (sockfd<0) {
+		perror("socket");
+		return 0;
+	}
+	struct sockaddr_in addr={
+		.sin_family=AF_INET,
+		.sin_port=htons(162),
+		.sin_addr.s_addr=htonl(INADDR_ANY)
+	};
+	if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr))!=0) {
+		perror("bind");
+		close(sockfd);
+		return 0;
+	}
+	//Higher priority than snmpgetter, so an event isn't stuck behind a poll.
+	MEM_TASK(snmptrap_task, "snmptrap", 4096, NULL, 6);
+	return 1;
+}
+
+void snmptrap_get_stats(int *received, int *shown) {
+	*received=traps_received;
+	*shown=traps_shown;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+/*
+SNMP trap/inform receiver. Listens on UDP port 162 so link changes and other events show up
+on the Dekatron right away, instead of waiting for the next poll to notice them.
+*/
+
+//Start listening. if_index is the interface we're watching; linkUp/linkDown traps for
+//other interfaces are ignored. trap_oids is a comma-separated list of additional trap OIDs
+//(or OID prefixes) to show, can be empty.
+int snmptrap_start(int if_index, const char *trap_oids);
+
+//Get the amount of traps received and the amount that were shown.
+void snmptrap_get_stats(int *received, int *shown);
@@ -0,0 +1,170 @@
+//Per-task CPU load and stack usage, based on the FreeRTOS run-time stats.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "dekatron.h"
+#include "taskstats.h"
+#include "membudget.h"
+
+static const char *TAG="taskstats";
+
+//Previous snapshot, to calculate the deltas from.
+typedef struct {
+	TaskHandle_t handle;
+	uint32_t runtime;
+} prev_t;
+
+/*
+The snapshot arrays are sized from the number of tasks and grow when more tasks show up;
+uxTaskGetSystemState returns nothing at all if the array is too small. The result keeps
+the first TASKSTATS_MAX_TASKS of them and counts the rest.
+*/
+static TaskStatus_t *ts;
+static int ts_cap=0;
+static prev_t *prev;
+static int prev_cap=0;
+static int prev_ct=0;
+static uint32_t prev_total;
+static uint32_t prev_isr_calls, prev_isr_us;
+
+static taskstats_t result;
+static int have_result=0;
+static SemaphoreHandle_t result_mux;
+
+static uint32_t prev_runtime_for(TaskHandle_t h, int *found) {
+	for (int i=0; i<prev_ct; i++) {
+		if (prev[i].handle==h) {
+			*found=1;
+			return prev[i].runtime;
+		}
+	}
+	*found=0;
+	return 0;
+}
+
+//Make sure *arr has room for n elements of size sz. Returns 0 if out of memory.
+static int grow(void **arr, int *cap, int n, size_t sz) {
+	if (n<=*cap) return 1;
+	void *p=realloc(*arr, n*sz);
+	if (!p) return 0;
+	*arr=p;
+	*cap=n;
+	return 1;
+}
+
+static void take_sample() {
+	uint32_t total;
+	int n=0;
+	while (n==0) {
+		//Some slack for tasks started between the count and the snapshot
+		int want=uxTaskGetNumberOfTasks()+4;
+		if (!grow((void**)&ts, &ts_cap, want, sizeof(TaskStatus_t)) ||
+				!grow((void**)&prev, &prev_cap, want, sizeof(prev_t))) {
+			ESP_LOGW(TAG, "No memory for %d tasks, skipping this window", want);
+			return;
+		}
+		n=uxTaskGetSystemState(ts, ts_cap, &total);
+	}
+	uint32_t isr_calls, isr_us, isr_max_cycles, isr_max_late_us;
+	deka_get_isr_stats(&isr_calls, &isr_us, &isr_max_cycles, &isr_max_late_us);
+
+	//Note: the run-time counter is in us, so the unsigned subtractions are fine over
+	//a wraparound.
+	uint32_t dt=total-prev_total;
+	xSemaphoreTake(result_mux, portMAX_DELAY);
+	if (prev_ct!=0 && dt!=0) {
+		result.window_ms=dt/1000;
+		result.ntasks=0;
+		result.tasks_dropped=0;
+		for (int i=0; i<n; i++) {
+			int found;
+			uint32_t last=prev_runtime_for(ts[i].xHandle, &found);
+			//Tasks that started during this window have no previous snapshot. Their runtime
+			//counter started at 0, so that works out.
+			uint32_t d=ts[i].ulRunTimeCounter-last;
+			if (result.ntasks==TASKSTATS_MAX_TASKS) {
+				result.tasks_dropped++;
+				continue;
+			}
+			taskstats_task_t *t=&result.task[result.ntasks++];
+			strncpy(t->name, ts[i].pcTaskName, sizeof(t->name)-1);
+			t->name[sizeof(t->name)-1]=0;
+			t->prio=ts[i].uxCurrentPriority;
+			t->cpu_permille=((uint64_t)d*1000)/dt;
+			t->stack_free=ts[i].usStackHighWaterMark;
+		}
+		//ISR time is measured on the cathode timer, so it's exact regardless of DFS.
+		result.isr_permille=((uint64_t)(isr_us-prev_isr_us)*1000)/dt;
+		result.isr_calls=isr_calls-prev_isr_calls;
+		result.isr_max_cycles=isr_max_cycles;
+		result.isr_max_late_us=isr_max_late_us;
+		have_result=1;
+	}
+	xSemaphoreGive(result_mux);
+
+	prev_ct=n;
+	for (int i=0; i<n; i++) {
+		prev[i].handle=ts[i].xHandle;
+		prev[i].runtime=ts[i].ulRunTimeCounter;
+	}
+	prev_total=total;
+	prev_isr_calls=isr_calls;
+	prev_isr_us=isr_us;
+}
+
+static void taskstats_task(void *arg) {
+	TickType_t last_wake=xTaskGetTickCount();
+	while(1) {
+		take_sample();
+#if CONFIG_DEKA_TASKSTATS_PRINT
+		taskstats_print();
+#endif
+		vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(CONFIG_DEKA_TASKSTATS_WINDOW_MS));
+	}
+}
+
+int taskstats_get(taskstats_t *st) {
+	if (!result_mux) return 0;
+	xSemaphoreTake(result_mux, portMAX_DELAY);
+	int r=have_result;
+	if (r) *st=result;
+	xSemaphoreGive(result_mux);
+	return r;
+}
+
+void taskstats_print() {
+	static taskstats_t st; //too big for most stacks
+	if (!taskstats_get(&st)) {
+		printf("No task stats yet.\n");
+		return;
+	}
+	printf("Task stats over %d ms:\n", st.window_ms);
+	printf("%-16s %4s %7s %10s\n", "task", "prio", "cpu", "stack free");
+	for (int i=0; i<st.ntasks; i++) {
+		printf("%-16s %4d %3d.%d%% %10d\n", st.task[i].name, st.task[i].prio,
+				st.task[i].cpu_permille/10, st.task[i].cpu_permille%10, st.task[i].stack_free);
+	}
+	if (st.tasks_dropped) printf("(%d more tasks not shown)\n", st.tasks_dropped);
+	printf("cathode ISR: %3d.%d%%, %d calls, max %d cycles, max %d us late\n", st.isr_permille/10, 
+			st.isr_permille%10, st.isr_calls, st.isr_max_cycles, st.isr_max_late_us);
+}
+
+void taskstats_start() {
+	result_mux=MEM_MUTEX();
+	MEM_TASK(taskstats_task, "taskstats", 3072, NULL, 1);
+	ESP_LOGI(TAG, "Sampling task stats every %d ms", CONFIG_DEKA_TASKSTATS_WINDOW_MS);
+}
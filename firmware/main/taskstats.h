@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+/*
+Sampling profiler. Every window, this takes a snapshot of the FreeRTOS run-time stats and
+stack high-water marks and calculates per-task CPU load over that window.
+*/
+
+#define TASKSTATS_MAX_TASKS 32
+
+typedef struct {
+	char name[configMAX_TASK_NAME_LEN];
+	int prio;
+	int cpu_permille;		//CPU use over the last window, in 0.1%
+	int stack_free;			//Minimum amount of free stack bytes ever
+} taskstats_task_t;
+
+typedef struct {
+	int window_ms;			//Actual length of the last window
+	int ntasks;
+	taskstats_task_t task[TASKSTATS_MAX_TASKS];
+	int tasks_dropped;		//Tasks that existed, but didn't fit in task[]
+	int isr_permille;		//Time spent in the cathode ISR, in 0.1%
+	int isr_calls;			//Cathode ISR calls during the window
+	int isr_max_cycles;		//Longest cathode ISR invocation
+	int isr_max_late_us;	//Longest delay between a cathode alarm and its ISR running
+} taskstats_t;
+
+//Start the sampler task.
+void taskstats_start();
+
+//Get the results of the last window. Returns 0 if no window has completed yet.
+int taskstats_get(taskstats_t *st);
+
+//Print the results of the last window as a table.
+void taskstats_print();
@@ -0,0 +1,342 @@
+//Daily and monthly traffic totals, persisted in NVS with few flash writes.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "cJSON.h"
+#include "trafstats.h"
+#include "membudget.h"
+#include "rtostrace.h"
+
+static const char *TAG="trafstats";
+
+/*
+Flash wear: the 'stats' partition is an NVS partition of its own, and NVS is a log already:
+a changed value is appended to the current page and the old one is marked as erased; a
+page only gets erased when it's garbage collected after the partition filled up. Every
+record is a 32-byte blob, which costs 3 NVS entries (96 bytes) per write. A flush writes
+at most two records (today and this month), and only if they changed, so at the default
+15 minute interval that's at most 96 flushes * 2 records * 96 bytes = 18K a day, plus
+two more records at midnight.
+The 64K partition has 15 usable pages, so any page gets erased about every 3 days, which
+is nothing compared to the 100K cycles the flash is good for. The config NVS partition
+isn't touched, so a full stats partition can't get in the way of saving settings.
+
+The sample path only adds to 'pending' in RAM; the task folds that into the day and month
+records, and writes them out. It also wakes up at midnight, so bytes end up in the day
+they were counted in, give or take one sample interval.
+*/
+//pdMS_TO_TICKS multiplies in 32 bits, which at 1000Hz overflows past about 71 minutes;
+//a day of ms times the tick rate needs 64.
+#define MS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms)*configTICK_RATE_HZ)/1000))
+#define FLUSH_TICKS MS_TO_TICKS(CONFIG_DEKA_TRAFSTATS_FLUSH_MIN*60*1000)
+#define UNSYNCED_POLL_MS 60000		//how often to check if SNTP has set the clock yet
+#define TIME_VALID 1600000000		//anything before this means the clock isn't set
+#define NVS_ENTRY_BYTES 32
+#define REC_NVS_BYTES (3*NVS_ENTRY_BYTES) //blob index, data header and data entries
+
+static portMUX_TYPE mux=portMUX_INITIALIZER_UNLOCKED;
+static nvs_handle_t nvs;
+static int port=-1;
+static int64_t last_in=-1, last_out=-1;
+static trafstats_rec_t pending;		//counted, but not in a day yet
+static trafstats_rec_t day, month;	//current day and month
+static int have_recs=0;
+static int day_dirty=0, month_dirty=0;
+static uint32_t flushes=0, flash_bytes=0, resets=0;
+
+//Days since 1970-01-01 for a date in the proleptic Gregorian calendar.
+static int days_from_civil(int y, int m, int d) {
+	y-=(m<=2);
+	int era=(y>=0?y:y-399)/400;
+	int yoe=y-era*400;
+	int doy=(153*(m+(m>2?-3:9))+2)/5+d-1;
+	int doe=yoe*365+yoe/4-yoe/100+doy;
+	return era*146097+doe-719468;
+}
+
+//...and the other way around.
+static void civil_from_days(int z, int *y, int *m, int *d) {
+	z+=719468;
+	int era=(z>=0?z:z-146096)/146097;
+	int doe=z-era*146097;
+	int yoe=(doe-doe/1460+doe/36524-doe/146096)/365;
+	int doy=doe-(365*yoe+yoe/4-yoe/100);
+	int mp=(5*doy+2)/153;
+	*d=doy-(153*mp+2)/5+1;
+	*m=mp+(mp<10?3:-9);
+	*y=yoe+era*400+(*m<=2);
+}
+
+static void rec_key(char *key, int is_month, const trafstats_rec_t *r) {
+	if (is_month) {
+		sprintf(key, "m%u.%u", r->port, r->period%TRAFSTATS_MONTHS);
+	} else {
+		sprintf(key, "d%u.%u", r->port, r->period%TRAFSTATS_DAYS);
+	}
+}
+
+//Get the stored record for this period, or an empty one if there's none (or an old one
+//that's in the same ring slot).
+static void rec_load(trafstats_rec_t *r, int is_month, int period) {
+	char key[16];
+	trafstats_rec_t n={.period=period, .port=port};
+	rec_key(key, is_month, &n);
+	size_t len=sizeof(*r);
+	if (nvs_get_blob(nvs, key, r, &len)!=ESP_OK || len!=sizeof(*r) || r->period!=period || r->port!=port) {
+		*r=n;
+	}
+}
+
+static void rec_store(const trafstats_rec_t *r, int is_month) {
+	char key[16];
+	rec_key(key, is_month, r);
+	esp_err_t err=nvs_set_blob(nvs, key, r, sizeof(*r));
+	if (err!=ESP_OK) {
+		ESP_LOGE(TAG, "Writing %s: %s", key, esp_err_to_name(err));
+		return;
+	}
+	flash_bytes+=REC_NVS_BYTES;
+}
+
+static void rec_add(trafstats_rec_t *r, const trafstats_rec_t *p) {
+	r->in_bytes+=p->in_bytes;
+	r->out_bytes+=p->out_bytes;
+	if (p->peak_in_bps>r->peak_in_bps) r->peak_in_bps=p->peak_in_bps;
+	if (p->peak_out_bps>r->peak_out_bps) r->peak_out_bps=p->peak_out_bps;
+}
+
+//Move the pending bytes into the day and month t is in. If that's a new day or month,
+//the old record is written out first.
+static void fold(time_t t) {
+	struct tm tm;
+	localtime_r(&t, &tm);
+	int d=days_from_civil(tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday);
+	int m=(tm.tm_year+1900)*12+tm.tm_mon;
+	//Only this task changes day and month, but the web page reads them, so any change
+	//happens under the mux.
+	trafstats_rec_t nd=day, nm=month;
+	if (!have_recs || day.period!=d) {
+		if (have_recs && day_dirty) rec_store(&day, 0);
+		rec_load(&nd, 0, d);
+		day_dirty=0;
+	}
+	if (!have_recs || month.period!=m) {
+		if (have_recs && month_dirty) rec_store(&month, 1);
+		rec_load(&nm, 1, m);
+		month_dirty=0;
+	}
+	portENTER_CRITICAL(&mux);
+	if (pending.in_bytes || pending.out_bytes || pending.peak_in_bps || pending.peak_out_bps) {
+		rec_add(&nd, &pending);
+		rec_add(&nm, &pending);
+		memset(&pending, 0, sizeof(pending));
+		day_dirty=1;
+		month_dirty=1;
+	}
+	day=nd;
+	month=nm;
+	have_recs=1;
+	portEXIT_CRITICAL(&mux);
+}
+
+static void flush() {
+	if (!day_dirty && !month_dirty) return;
+	RTOSTRACE_BEGIN(RTOSTRACE_MARK_NVS_FLUSH);
+	if (day_dirty) rec_store(&day, 0);
+	if (month_dirty) rec_store(&month, 1);
+	nvs_commit(nvs);
+	RTOSTRACE_END(RTOSTRACE_MARK_NVS_FLUSH);
+	day_dirty=0;
+	month_dirty=0;
+	flushes++;
+}
+
+//Start of the next day, local time.
+static time_t next_midnight(time_t now) {
+	struct tm tm;
+	localtime_r(&now, &tm);
+	tm.tm_hour=0;
+	tm.tm_min=0;
+	tm.tm_sec=0;
+	tm.tm_mday++;
+	tm.tm_isdst=-1;
+	return mktime(&tm);
+}
+
+static void trafstats_task(void *arg) {
+	TickType_t next_flush=xTaskGetTickCount()+FLUSH_TICKS;
+	while(1) {
+		time_t now=time(NULL);
+		if (now<TIME_VALID) {
+			vTaskDelay(pdMS_TO_TICKS(UNSYNCED_POLL_MS));
+			continue;
+		}
+		int32_t to_flush=next_flush-xTaskGetTickCount();
+		if (to_flush<0) to_flush=0;
+		time_t midnight=next_midnight(now);
+		TickType_t to_midnight=MS_TO_TICKS((midnight-now)*1000);
+		if (to_midnight<(TickType_t)to_flush) {
+			//Fold whatever came in today into today, then start on the new one.
+			vTaskDelay(to_midnight);
+			fold(midnight-1);
+			flush();
+		} else {
+			vTaskDelay(to_flush);
+			fold(time(NULL));
+			flush();
+			next_flush+=FLUSH_TICKS;
+			if ((int32_t)(next_flush-xTaskGetTickCount())<0) next_flush=xTaskGetTickCount()+FLUSH_TICKS;
+		}
+	}
+}
+
+void trafstats_start(int ifindex) {
+	esp_err_t err=nvs_flash_init_partition("stats");
+	if (err==ESP_ERR_NVS_NO_FREE_PAGES || err==ESP_ERR_NVS_NEW_VERSION_FOUND) {
+		ESP_LOGW(TAG, "Stats partition unusable, erasing it");
+		ESP_ERROR_CHECK(nvs_flash_erase_partition("stats"));
+		err=nvs_flash_init_partition("stats");
+	}
+	if (err==ESP_OK) err=nvs_open_from_partition("stats", "traffic", NVS_READWRITE, &nvs);
+	if (err!=ESP_OK) {
+		ESP_LOGW(TAG, "No stats partition (%s), not keeping traffic statistics.", esp_err_to_name(err));
+		return;
+	}
+	port=(ifindex<0)?0:ifindex;
+	MEM_TASK(trafstats_task, "trafstats", 3072, NULL, 1);
+	ESP_LOGI(TAG, "Keeping traffic statistics for port %d, flushing every %d min", port, CONFIG_DEKA_TRAFSTATS_FLUSH_MIN);
+}
+
+void trafstats_add(int64_t in_bytes, int64_t out_bytes, const snmpgetter_bw_t *bw) {
+	if (port<0) return;
+	portENTER_CRITICAL(&mux);
+	if (last_in!=-1) {
+		//32-bit counters, same as ratecalc. A jump of over 2G is more likely the agent
+		//rebooting and starting from 0 than real traffic; don't count it.
+		int64_t diff_in=in_bytes-last_in;
+		int64_t diff_out=out_bytes-last_out;
+		if (diff_in<0) diff_in+=(1ULL<<32);
+		if (diff_out<0) diff_out+=(1ULL<<32);
+		if (diff_in<(1LL<<31) && diff_out<(1LL<<31)) {
+			pending.in_bytes+=diff_in;
+			pending.out_bytes+=diff_out;
+		} else {
+			resets++;
+		}
+	}
+	last_in=in_bytes;
+	last_out=out_bytes;
+	if (bw) {
+		if ((uint32_t)bw->bps_in>pending.peak_in_bps) pending.peak_in_bps=bw->bps_in;
+		if ((uint32_t)bw->bps_out>pending.peak_out_bps) pending.peak_out_bps=bw->bps_out;
+	}
+	portEXIT_CRITICAL(&mux);
+}
+
+static cJSON *rec_json(const trafstats_rec_t *r, int is_month) {
+	char date[16];
+	if (is_month) {
+		sprintf(date, "%04d-%02d", r->period/12, r->period%12+1);
+	} else {
+		int y, m, d;
+		civil_from_days(r->period, &y, &m, &d);
+		sprintf(date, "%04d-%02d-%02d", y, m, d);
+	}
+	cJSON *o=cJSON_CreateObject();
+	cJSON_AddNumberToObject(o, "port", r->port);
+	cJSON_AddStringToObject(o, is_month?"month":"date", date);
+	cJSON_AddNumberToObject(o, "in_bytes", r->in_bytes);
+	cJSON_AddNumberToObject(o, "out_bytes", r->out_bytes);
+	cJSON_AddNumberToObject(o, "peak_in_bps", r->peak_in_bps);
+	cJSON_AddNumberToObject(o, "peak_out_bps", r->peak_out_bps);
+	return o;
+}
+
+static int rec_cmp(const void *a, const void *b) {
+	const trafstats_rec_t *x=a, *y=b;
+	if (x->port!=y->port) return x->port-y->port;
+	return x->period-y->period;
+}
+
+//Reads all stored records of one kind, with the current one from RAM instead of flash.
+static int collect(trafstats_rec_t **out, int is_month, const trafstats_rec_t *cur) {
+	int max=is_month?TRAFSTATS_MONTHS:TRAFSTATS_DAYS;
+	int n=0, cap=max+1;
+	trafstats_rec_t *recs=malloc(cap*sizeof(trafstats_rec_t));
+	if (!recs) return 0;
+	nvs_iterator_t it=NULL;
+	esp_err_t res=nvs_entry_find("stats", "traffic", NVS_TYPE_BLOB, &it);
+	while (res==ESP_OK) {
+		nvs_entry_info_t info;
+		nvs_entry_info(it, &info);
+		if (info.key[0]==(is_month?'m':'d')) {
+			if (n==cap) {
+				cap*=2;
+				trafstats_rec_t *nr=realloc(recs, cap*sizeof(trafstats_rec_t));
+				if (!nr) break;
+				recs=nr;
+			}
+			size_t len=sizeof(trafstats_rec_t);
+			if (nvs_get_blob(nvs, info.key, &recs[n], &len)==ESP_OK && len==sizeof(trafstats_rec_t)) {
+				if (!cur || recs[n].port!=cur->port || recs[n].period!=cur->period) n++;
+			}
+		}
+		res=nvs_entry_next(&it);
+	}
+	nvs_release_iterator(it);
+	if (cur && n<cap) recs[n++]=*cur;
+	qsort(recs, n, sizeof(trafstats_rec_t), rec_cmp);
+	*out=recs;
+	return n;
+}
+
+char *trafstats_render_json() {
+	cJSON *root=cJSON_CreateObject();
+	time_t now=time(NULL);
+	cJSON_AddBoolToObject(root, "time_valid", now>=TIME_VALID);
+	cJSON_AddNumberToObject(root, "port", port);
+	cJSON_AddNumberToObject(root, "flush_interval_min", CONFIG_DEKA_TRAFSTATS_FLUSH_MIN);
+	cJSON_AddNumberToObject(root, "flushes", flushes);
+	cJSON_AddNumberToObject(root, "flash_bytes_written", flash_bytes);
+	cJSON_AddNumberToObject(root, "counter_resets", resets);
+	if (port>=0) {
+		//Today and this month, including what hasn't been folded in yet.
+		trafstats_rec_t cur_day, cur_month, pend;
+		portENTER_CRITICAL(&mux);
+		int have=have_recs;
+		cur_day=day;
+		cur_month=month;
+		pend=pending;
+		portEXIT_CRITICAL(&mux);
+		rec_add(&cur_day, &pend);
+		rec_add(&cur_month, &pend);
+		//Before the clock is set, there's no day to put this in yet.
+		if (!have) {
+			cJSON_AddNumberToObject(root, "unassigned_in_bytes", pend.in_bytes);
+			cJSON_AddNumberToObject(root, "unassigned_out_bytes", pend.out_bytes);
+		}
+		for (int is_month=0; is_month<2; is_month++) {
+			trafstats_rec_t *recs=NULL;
+			int n=collect(&recs, is_month, have?(is_month?&cur_month:&cur_day):NULL);
+			cJSON *arr=cJSON_AddArrayToObject(root, is_month?"months":"days");
+			for (int i=0; i<n; i++) cJSON_AddItemToArray(arr, rec_json(&recs[i], is_month));
+			free(recs);
+		}
+	}
+	char *txt=cJSON_Print(root);
+	cJSON_Delete(root);
+	return txt;
+}
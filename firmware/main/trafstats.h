@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include "snmpgetter.h"
+
+/*
+Persistent traffic statistics: daily and monthly byte totals and peak rates for the port
+we're polling, kept in their own NVS partition ('stats') so they survive reboots. Samples
+are added up in RAM and only written out every CONFIG_DEKA_TRAFSTATS_FLUSH_MIN minutes,
+and when a day or month ends. Days and months are in local time (see the 'tz' setting),
+so nothing is counted before SNTP has set the clock; bytes from before that go to the
+first day we know.
+*/
+
+#define TRAFSTATS_DAYS 31		//days kept per port
+#define TRAFSTATS_MONTHS 24		//months kept per port
+
+//One record, stored as an NVS blob. 32 bytes, so it takes a single NVS data entry.
+typedef struct {
+	uint16_t period;		//days since 1970-01-01, or year*12+month (month 0-11)
+	uint16_t port;			//ifIndex the bytes were counted on
+	uint32_t reserved;
+	uint64_t in_bytes;
+	uint64_t out_bytes;
+	uint32_t peak_in_bps;	//highest rate of a single sample, bytes per second
+	uint32_t peak_out_bps;
+} trafstats_rec_t;
+
+//Start keeping statistics for the port with the given ifIndex.
+void trafstats_start(int port);
+
+//Add a sample of the raw counters. bw is the rate snmpgetter calculated from it, or NULL if
+//there is none (yet).
+void trafstats_add(int64_t in_bytes, int64_t out_bytes, const snmpgetter_bw_t *bw);
+
+//Renders all stored statistics as JSON. Caller frees.
+char *trafstats_render_json();
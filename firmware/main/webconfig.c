@@ -27,6 +27,17 @@
 #include <freertos/task.h>
 #include <freertos/semphr.h>
 #include "dekatron.h"
+#include "taskstats.h"
+#include "membudget.h"
+#include "fastboot.h"
+#include "snmptrap.h"
+#include "samplelog.h"
+#include "blog.h"
+#include "esp_app_desc.h"
+#include "snmpgetter.h"
+#include "trafstats.h"
+#include "wifips.h"
+#include "rtostrace.h"
 
 #include "wifi_manager.h"
 #include "http_app.h"
@@ -38,8 +49,12 @@ extern const char root_html_start[] asm("_binary_root_html_start");
 extern const char root_html_end[] asm("_binary_root_html_end");
 
 //keep in sync with html
-static const char* fields[]={"snmpip", "community", "oid_in", "oid_out", "max_bw_bps", "rotation", NULL};
-static const char* defaults[]={"10.0.0.1", "public", ".1.3.6.1.2.1.2.2.1.10.1", ".1.3.6.1.2.1.2.2.1.16.1", "1G", "0"};
+static const char* fields[]={"snmpip", "community", "oid_in", "oid_out", "max_bw_bps", "rotation",
+		"show_ip", "static_ip", "static_mask", "static_gw", "trap_oids",
+		"agent_community", "tz", "wifi_ps", "listen_int", "display_mode", NULL};
+static const char* defaults[]={"10.0.0.1", "public", ".1.3.6.1.2.1.2.2.1.10.1", ".1.3.6.1.2.1.2.2.1.16.1", "1G", "0",
+		"always", "", "255.255.255.0", "", "",
+		"", "UTC0", "min", "3", "single"};
 
 static nvs_handle_t nvs;
 
@@ -52,6 +67,78 @@ void webconfig_set_usbpd(int mv, int ma) {
 	usbpd_ma=ma;
 }
 
+static int trace_send_sector(const uint8_t *sector, void *arg) {
+	httpd_req_t *req=(httpd_req_t*)arg;
+	return (httpd_resp_send_chunk(req, (const char*)sector, SLOG_SECTOR_SIZE)!=ESP_OK);
+}
+
+#if CONFIG_DEKA_RTOSTRACE
+static int rtostrace_send(const void *data, size_t len, void *arg) {
+	httpd_req_t *req=(httpd_req_t*)arg;
+	return (httpd_resp_send_chunk(req, (const char*)data, len)!=ESP_OK);
+}
+#endif
+
+//Renders the values for all the fields the webpage shows as JSON. Caller frees.
+char *webconfig_render_getfields() {
+	cJSON *root=cJSON_CreateObject();
+	cJSON *vars=cJSON_AddArrayToObject(root, "vars");
+	int i=0;
+	//Get the fields from NVS and add to JSON.
+	while (fields[i]!=NULL) {
+		char buf[256];
+		size_t length=sizeof(buf);
+		if (nvs_get_str(nvs, fields[i], buf, &length)!=ESP_OK) {
+			//technically shouldn't happen as we set defaults early on, but hey, belts'n'braces...
+			strcpy(buf, defaults[i]);
+		}
+		cJSON *var=cJSON_CreateObject();
+		cJSON_AddStringToObject(var, "el", fields[i]);
+		cJSON_AddStringToObject(var, "val", buf);
+		cJSON_AddItemToArray(vars, var);
+		i++;
+	}
+	//Also add some debug values.
+	cJSON_AddNumberToObject(root, "usbpd_mv", usbpd_mv);
+	cJSON_AddNumberToObject(root, "usbpd_ma", usbpd_ma);
+	cJSON_AddNumberToObject(root, "deka_pwm", deka_get_pwm());
+	cJSON_AddNumberToObject(root, "deka_posdet", deka_get_posdet_ct());
+	deka_hv_stats_t hv;
+	deka_get_hv_stats(&hv);
+	cJSON_AddNumberToObject(root, "hv_mv", hv.hv_mv);
+	cJSON_AddNumberToObject(root, "hv_tgt_mv", hv.tgt_mv);
+	cJSON_AddNumberToObject(root, "hv_settle_ms", hv.settle_ms);
+	cJSON_AddNumberToObject(root, "hv_overshoot_mv", hv.overshoot_mv);
+	cJSON_AddNumberToObject(root, "hv_ripple_mv", hv.ripple_mv);
+	membudget_t mb;
+	membudget_get(&mb);
+	cJSON_AddNumberToObject(root, "mem_static", mb.static_bytes);
+	cJSON_AddNumberToObject(root, "heap_used", mb.heap_used);
+	cJSON_AddNumberToObject(root, "heap_min_free", mb.heap_min_free);
+	cJSON_AddNumberToObject(root, "heap_largest", mb.heap_largest);
+	deka_refresh_stats_t rs;
+	deka_get_refresh_stats(&rs);
+	cJSON_AddNumberToObject(root, "refresh_hz", rs.refresh_hz_x10/10.0);
+	cJSON_AddNumberToObject(root, "refresh_tgt_hz", rs.target_hz);
+	cJSON_AddNumberToObject(root, "linearity_err_ppm", rs.linearity_err_ppm);
+	int traps_rx, traps_shown;
+	snmptrap_get_stats(&traps_rx, &traps_shown);
+	cJSON_AddNumberToObject(root, "traps_rx", traps_rx);
+	cJSON_AddNumberToObject(root, "traps_shown", traps_shown);
+	int slog_written, slog_dropped, slog_errors;
+	samplelog_get_stats(&slog_written, &slog_dropped, &slog_errors);
+	cJSON_AddNumberToObject(root, "trace_written", slog_written);
+	cJSON_AddNumberToObject(root, "trace_dropped", slog_dropped);
+	cJSON_AddNumberToObject(root, "trace_flash_errors", slog_errors);
+	cJSON *boot=cJSON_AddObjectToObject(root, "boot_ms");
+	for (int i=0; i<BOOT_EV_COUNT; i++) {
+		cJSON_AddNumberToObject(boot, boottime_name(i), boottime_get_ms(i));
+	}
+	char *txt=cJSON_Print(root);
+	cJSON_Delete(root);
+	return txt;
+}
+
 static esp_err_t webconfig_get_handler(httpd_req_t *req) {
 	if(strcmp(req->uri, "/") == 0) {
 		httpd_resp_set_status(req, "200 OK");
@@ -59,34 +146,152 @@ static esp_err_t webconfig_get_handler(httpd_req_t *req) {
 		httpd_resp_send(req, root_html_start, root_html_end-root_html_start);
 	} else if(strcmp(req->uri, "/getfields") == 0) {
 		//The webpage will get the values for all its fields from here.
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "text/json");
+		char *txt=webconfig_render_getfields();
+		if (txt) {
+			httpd_resp_send(req, txt, strlen(txt));
+			free(txt);
+		}
+	} else if(strcmp(req->uri, "/taskstats") == 0) {
+		static taskstats_t st; //too big for the httpd stack
 		cJSON *root=cJSON_CreateObject();
-		cJSON *vars=cJSON_AddArrayToObject(root, "vars");
-		int i=0;
-		//Get the fields from NVS and add to JSON.
-		while (fields[i]!=NULL) {
-			char buf[256];
-			size_t length=sizeof(buf);
-			if (nvs_get_str(nvs, fields[i], buf, &length)!=ESP_OK) {
-				//technically shouldn't happen as we set defaults early on, but hey, belts'n'braces...
-				strcpy(buf, defaults[i]);
+		if (taskstats_get(&st)) {
+			cJSON_AddNumberToObject(root, "window_ms", st.window_ms);
+			cJSON *tasks=cJSON_AddArrayToObject(root, "tasks");
+			for (int i=0; i<st.ntasks; i++) {
+				cJSON *t=cJSON_CreateObject();
+				cJSON_AddStringToObject(t, "name", st.task[i].name);
+				cJSON_AddNumberToObject(t, "prio", st.task[i].prio);
+				cJSON_AddNumberToObject(t, "cpu_pct", st.task[i].cpu_permille/10.0);
+				cJSON_AddNumberToObject(t, "stack_free", st.task[i].stack_free);
+				cJSON_AddItemToArray(tasks, t);
 			}
-			cJSON *var=cJSON_CreateObject();
-			cJSON_AddStringToObject(var, "el", fields[i]);
-			cJSON_AddStringToObject(var, "val", buf);
-			cJSON_AddItemToArray(vars, var);
-			i++;
+			cJSON_AddNumberToObject(root, "tasks_dropped", st.tasks_dropped);
+			cJSON_AddNumberToObject(root, "isr_pct", st.isr_permille/10.0);
+			cJSON_AddNumberToObject(root, "isr_calls", st.isr_calls);
+			cJSON_AddNumberToObject(root, "isr_max_cycles", st.isr_max_cycles);
+			cJSON_AddNumberToObject(root, "isr_max_late_us", st.isr_max_late_us);
 		}
-		//Also add some debug values.
-		cJSON_AddNumberToObject(root, "usbpd_mv", usbpd_mv);
-		cJSON_AddNumberToObject(root, "usbpd_ma", usbpd_ma);
-		cJSON_AddNumberToObject(root, "deka_pwm", deka_get_pwm());
-		cJSON_AddNumberToObject(root, "deka_posdet", deka_get_posdet_ct());
-		//Return the JSON.
 		httpd_resp_set_status(req, "200 OK");
 		httpd_resp_set_type(req, "text/json");
-		const char *txt=cJSON_Print(root);
+		char *txt=cJSON_Print(root);
 		if (txt) {
 			httpd_resp_send(req, txt, strlen(txt));
+			free(txt);
+		}
+		cJSON_Delete(root);
+	} else if(strcmp(req->uri, "/snmpstats") == 0 || strcmp(req->uri, "/snmpstats/reset") == 0) {
+		if (strcmp(req->uri, "/snmpstats/reset") == 0) snmpgetter_reset_stats();
+		snmpgetter_stats_t st;
+		snmpgetter_get_stats(&st);
+		cJSON *root=cJSON_CreateObject();
+		cJSON_AddStringToObject(root, "target", snmpgetter_get_target());
+		cJSON_AddNumberToObject(root, "requests", st.requests);
+		cJSON_AddNumberToObject(root, "replies", st.replies);
+		cJSON_AddNumberToObject(root, "timeouts", st.timeouts);
+		cJSON_AddNumberToObject(root, "retransmits", st.retransmits);
+		cJSON_AddNumberToObject(root, "errors", st.errors);
+		cJSON_AddNumberToObject(root, "decode_fail", st.decode_fail);
+		cJSON_AddNumberToObject(root, "late", st.late);
+		cJSON_AddNumberToObject(root, "stray", st.stray);
+		cJSON_AddNumberToObject(root, "rtt_last_us", st.rtt_last_us);
+		cJSON_AddNumberToObject(root, "rtt_min_us", st.rtt_min_us);
+		cJSON_AddNumberToObject(root, "rtt_max_us", st.rtt_max_us);
+		cJSON_AddNumberToObject(root, "rtt_avg_us", st.rtt_samples?(st.rtt_sum_us/st.rtt_samples):0);
+		//Histogram as [upper bound in us, count] pairs; the last bucket has no upper bound.
+		cJSON *hist=cJSON_AddArrayToObject(root, "rtt_hist");
+		for (int i=0; i<SNMPGETTER_RTT_BUCKETS; i++) {
+			cJSON *b=cJSON_CreateArray();
+			cJSON_AddItemToArray(b, (i==SNMPGETTER_RTT_BUCKETS-1)?cJSON_CreateNull():cJSON_CreateNumber(256<<i));
+			cJSON_AddItemToArray(b, cJSON_CreateNumber(st.rtt_hist[i]));
+			cJSON_AddItemToArray(hist, b);
+		}
+		cJSON_AddNumberToObject(root, "intervals", st.intervals);
+		cJSON_AddNumberToObject(root, "interval_last_us", st.interval_last_us);
+		cJSON_AddNumberToObject(root, "interval_sched_us", st.interval_sched_us);
+		cJSON_AddNumberToObject(root, "interval_avg_us", st.interval_avg_us);
+		cJSON_AddNumberToObject(root, "interval_max_us", st.interval_max_us);
+		cJSON_AddNumberToObject(root, "jitter_us", st.jitter_us);
+		cJSON_AddNumberToObject(root, "cadence_changes", st.cadence_changes);
+		cJSON_AddNumberToObject(root, "srtt_us", st.srtt_us);
+		cJSON_AddNumberToObject(root, "rttvar_us", st.rttvar_us);
+		cJSON_AddNumberToObject(root, "rto_us", st.rto_us);
+		cJSON_AddNumberToObject(root, "aliased", st.aliased);
+		cJSON_AddNumberToObject(root, "ctr_period_us", st.ctr_period_us);
+		cJSON_AddNumberToObject(root, "ctr_window_us", st.ctr_window_us);
+		cJSON_AddBoolToObject(root, "ctr_locked", st.ctr_locked);
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "text/json");
+		char *txt=cJSON_Print(root);
+		if (txt) {
+			httpd_resp_send(req, txt, strlen(txt));
+			free(txt);
+		}
+		cJSON_Delete(root);
+	} else if(strcmp(req->uri, "/trace") == 0) {
+		//Raw sample trace, oldest sector first. See tools/ for what to do with it.
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "application/octet-stream");
+		httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"trace.bin\"");
+		samplelog_read(trace_send_sector, req);
+		httpd_resp_send_chunk(req, NULL, 0);
+#if CONFIG_DEKA_RTOSTRACE
+	} else if(strcmp(req->uri, "/rtostrace") == 0) {
+		//RTOS timeline; convert with tools/rtostrace_json. Downloading re-arms the trigger.
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "application/octet-stream");
+		httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"rtostrace.bin\"");
+		rtostrace_read(rtostrace_send, req);
+		httpd_resp_send_chunk(req, NULL, 0);
+#endif
+	} else if(strcmp(req->uri, "/blog") == 0) {
+		//Binary log ring; decode with tools/blog_decode and the matching ELF file.
+		static blog_rec_t recs[BLOG_RING_SIZE]; //too big for the httpd stack
+		blog_dump_hdr_t hdr={.magic=BLOG_MAGIC, .rec_size=sizeof(blog_rec_t)};
+		uint32_t dropped;
+		hdr.nrec=blog_snapshot(recs, BLOG_RING_SIZE, &dropped);
+		hdr.dropped=dropped;
+		char sha[sizeof(hdr.elf_sha)+1];
+		esp_app_get_elf_sha256(sha, sizeof(sha));
+		memcpy(hdr.elf_sha, sha, sizeof(hdr.elf_sha));
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "application/octet-stream");
+		httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"blog.bin\"");
+		httpd_resp_send_chunk(req, (const char*)&hdr, sizeof(hdr));
+		httpd_resp_send_chunk(req, (const char*)recs, hdr.nrec*sizeof(blog_rec_t));
+		httpd_resp_send_chunk(req, NULL, 0);
+	} else if(strcmp(req->uri, "/trafstats") == 0) {
+		char *txt=trafstats_render_json();
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "text/json");
+		if (txt) {
+			httpd_resp_send(req, txt, strlen(txt));
+			free(txt);
+		} else {
+			httpd_resp_send(req, "{}", 2);
+		}
+	} else if(strcmp(req->uri, "/wifips") == 0) {
+		wifips_mode_stats_t st[WIFIPS_COUNT];
+		int li;
+		int cur=wifips_get_stats(&li, st);
+		cJSON *root=cJSON_CreateObject();
+		cJSON_AddStringToObject(root, "wifi_ps", wifips_mode_name(cur));
+		cJSON_AddNumberToObject(root, "listen_int", li);
+		cJSON *modes=cJSON_AddObjectToObject(root, "modes");
+		for (int i=0; i<WIFIPS_COUNT; i++) {
+			cJSON *m=cJSON_AddObjectToObject(modes, wifips_mode_name(i));
+			cJSON_AddNumberToObject(m, "time_s", (double)(st[i].time_ms/1000));
+			cJSON_AddNumberToObject(m, "rtt_samples", st[i].rtt_samples);
+			cJSON_AddNumberToObject(m, "rtt_avg_us", st[i].rtt_samples?(double)(st[i].rtt_sum_us/st[i].rtt_samples):0);
+			cJSON_AddNumberToObject(m, "rtt_max_us", st[i].rtt_max_us);
+		}
+		httpd_resp_set_status(req, "200 OK");
+		httpd_resp_set_type(req, "text/json");
+		char *txt=cJSON_Print(root);
+		if (txt) {
+			httpd_resp_send(req, txt, strlen(txt));
+			free(txt);
 		}
 		cJSON_Delete(root);
 	} else {
@@ -100,26 +305,40 @@ static void reset_cb(void *arg) {
 	esp_restart();
 }
 
+//Receive the body of a POST. Returns a malloc'ed string, or NULL after sending a 500.
+static char *recv_body(httpd_req_t *req) {
+	char *buf=malloc(req->content_len+1);
+	if (!buf) {
+		httpd_resp_send_500(req);
+		return NULL;
+	}
+	int p=0;
+	while (p!=req->content_len) {
+		//Receive the POST data.
+		int ret=httpd_req_recv(req, buf+p, req->content_len-p);
+		if (ret>=0) {
+			p+=ret;
+		} else if (ret==HTTPD_SOCK_ERR_TIMEOUT) {
+			//just wait a bit longer
+		} else {
+			ESP_LOGE(TAG, "httpd_req_recv failed");
+			httpd_resp_send_500(req);
+			free(buf);
+			return NULL;
+		}
+	}
+	buf[p]=0;
+	return buf;
+}
+
 static esp_err_t webconfig_post_handler(httpd_req_t *req) {
 	if(strcmp(req->uri, "/setfields") == 0) {
 		//The webpage posts here to set the configuration values.
-		char *buf=malloc(req->content_len);
-		int p=0;
-		while (p!=req->content_len) {
-			//Receive the POST data.
-			int ret=httpd_req_recv(req, buf+p, req->content_len-p);
-			if (ret>=0) {
-				p+=ret;
-			} else if (ret==HTTPD_SOCK_ERR_TIMEOUT) {
-				//just wait a bit longer
-			} else {
-				ESP_LOGE(TAG, "httpd_req_recv failed");
-				httpd_resp_send_500(req);
-				return ESP_OK;
-			}
-		}
+		char *buf=recv_body(req);
+		if (!buf) return ESP_OK;
 		//Okay, we got the JSON data. Get the values from there and save to NVS.
 		cJSON *root = cJSON_Parse(buf);
+		free(buf);
 		if (root) {
 			nvs_handle_t lnvs;
 			nvs_open("config", NVS_READWRITE, &lnvs);
@@ -142,16 +361,49 @@ static esp_err_t webconfig_post_handler(httpd_req_t *req) {
 			esp_timer_handle_t resettimer;
 			esp_timer_create(&timerargs, &resettimer);
 			esp_timer_start_once(resettimer, 1*1000*1000UL);
+			cJSON_Delete(root);
 		}
 		httpd_resp_set_status(req, "200 OK");
 		httpd_resp_set_type(req, "text/plain");
 		httpd_resp_send(req, "OK!", 3);
+	} else if(strcmp(req->uri, "/wifips") == 0) {
+		//Switch the power save profile without the reboot /setfields does.
+		char *buf=recv_body(req);
+		if (!buf) return ESP_OK;
+		cJSON *root=cJSON_Parse(buf);
+		free(buf);
+		const char *mode=cJSON_GetStringValue(cJSON_GetObjectItem(root, "wifi_ps"));
+		const char *li=cJSON_GetStringValue(cJSON_GetObjectItem(root, "listen_int"));
+		int ok=(mode && li && wifips_set(mode, atoi(li)));
+		cJSON_Delete(root);
+		if (ok) {
+			httpd_resp_set_status(req, "200 OK");
+			httpd_resp_set_type(req, "text/plain");
+			httpd_resp_send(req, "OK!", 3);
+		} else {
+			httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Need wifi_ps (none/min/max) and listen_int");
+		}
 	} else {
 		httpd_resp_send_404(req);
 	}
 	return ESP_OK;
 }
 
+//These mark HTTP requests in the RTOS trace.
+static esp_err_t webconfig_get_handler_traced(httpd_req_t *req) {
+	RTOSTRACE_BEGIN(RTOSTRACE_MARK_HTTP_GET);
+	esp_err_t r=webconfig_get_handler(req);
+	RTOSTRACE_END(RTOSTRACE_MARK_HTTP_GET);
+	return r;
+}
+
+static esp_err_t webconfig_post_handler_traced(httpd_req_t *req) {
+	RTOSTRACE_BEGIN(RTOSTRACE_MARK_HTTP_POST);
+	esp_err_t r=webconfig_post_handler(req);
+	RTOSTRACE_END(RTOSTRACE_MARK_HTTP_POST);
+	return r;
+}
+
 void webconfig_set_defaults() {
 	int i=0;
 	nvs_handle_t lnvs;
@@ -184,8 +436,8 @@ void webconfig_start() {
 	}
 	nvs_open("config", NVS_READONLY, &nvs);
 	webconfig_set_defaults();
-	http_app_set_handler_hook(HTTP_GET, &webconfig_get_handler);
-	http_app_set_handler_hook(HTTP_POST, &webconfig_post_handler);
+	http_app_set_handler_hook(HTTP_GET, &webconfig_get_handler_traced);
+	http_app_set_handler_hook(HTTP_POST, &webconfig_post_handler_traced);
 
 	ESP_LOGI(TAG,"Webconfig started.");
 }
@@ -199,4 +451,12 @@ int webconfig_get_config_str(const char *key, char *ret, size_t retlen) {
 	}
 }
 
+int webconfig_set_config_str(const char *key, const char *val) {
+	nvs_handle_t lnvs;
+	if (nvs_open("config", NVS_READWRITE, &lnvs)!=ESP_OK) return 0;
+	esp_err_t err=nvs_set_str(lnvs, key, val);
+	if (err==ESP_OK) err=nvs_commit(lnvs);
+	nvs_close(lnvs);
+	return (err==ESP_OK);
+}
 
@@ -5,5 +5,9 @@
 void webconfig_start();
 //Get a config string, as set by the webconfig and stored in nvs.
 int webconfig_get_config_str(const char *key, char *ret, size_t retlen);
+//Change a single config string in nvs, without the reboot the webpage does. Returns 0 on error.
+int webconfig_set_config_str(const char *key, const char *val);
 //This sets the voltage and current capability field values displayed on the webpage.
 void webconfig_set_usbpd(int mv, int ma);
+//Render the /getfields JSON. Returns a malloc'ed string, or NULL if out of memory.
+char *webconfig_render_getfields();
@@ -0,0 +1,136 @@
+//WiFi power save profile selection and per-profile statistics.
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "wifi_manager.h"
+#include "webconfig.h"
+#include "wifips.h"
+
+static const char *TAG="wifips";
+
+/*
+There's no way to measure the supply current on the board. What differs between the
+profiles is how long the radio sleeps between beacons, and the chip itself never goes to
+light sleep while the tube is on (see deka_start), so CPU idle or sleep time doesn't tell
+the profiles apart either. What we keep is the cost side, the SNMP RTT, plus how long
+each profile was active; for actual mA numbers, put a USB power meter in front of it and
+use the time to see which profile was active when.
+*/
+#define LISTEN_INT_MAX 10	//more than a second of latency at the usual 102.4ms beacon interval
+
+static const char *mode_names[WIFIPS_COUNT]={"none", "min", "max"};
+static const wifi_ps_type_t mode_ps[WIFIPS_COUNT]={WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM};
+
+static portMUX_TYPE mux=portMUX_INITIALIZER_UNLOCKED;
+static int mode=WIFIPS_MIN;
+static int listen_int=3;
+static int connected=0;
+static int64_t mode_start_us;
+static wifips_mode_stats_t stats[WIFIPS_COUNT];
+
+const char *wifips_mode_name(int m) {
+	return (m>=0 && m<WIFIPS_COUNT)?mode_names[m]:"?";
+}
+
+static int parse_mode(const char *name) {
+	for (int i=0; i<WIFIPS_COUNT; i++) {
+		if (strcmp(name, mode_names[i])==0) return i;
+	}
+	return -1;
+}
+
+//Account the time since mode_start_us to the current mode. Needs mux.
+static void close_period(int64_t now) {
+	if (connected) stats[mode].time_ms+=(now-mode_start_us)/1000;
+	mode_start_us=now;
+}
+
+void wifips_init() {
+	char buf[16]="min";
+	webconfig_get_config_str("wifi_ps", buf, sizeof(buf));
+	int m=parse_mode(buf);
+	if (m>=0) mode=m;
+	if (webconfig_get_config_str("listen_int", buf, sizeof(buf))) listen_int=atoi(buf);
+	if (listen_int<1) listen_int=1;
+	if (listen_int>LISTEN_INT_MAX) listen_int=LISTEN_INT_MAX;
+}
+
+int wifips_listen_interval() {
+	return listen_int;
+}
+
+void wifips_apply() {
+	ESP_LOGI(TAG, "Power save %s, listen interval %d", mode_names[mode], listen_int);
+	esp_wifi_set_ps(mode_ps[mode]);
+	portENTER_CRITICAL(&mux);
+	close_period(esp_timer_get_time());
+	connected=1;
+	portEXIT_CRITICAL(&mux);
+}
+
+void wifips_disconnected() {
+	portENTER_CRITICAL(&mux);
+	close_period(esp_timer_get_time());
+	connected=0;
+	portEXIT_CRITICAL(&mux);
+}
+
+int wifips_set(const char *name, int li) {
+	int m=parse_mode(name);
+	if (m<0) return 0;
+	if (li<1) li=1;
+	if (li>LISTEN_INT_MAX) li=LISTEN_INT_MAX;
+	char buf[16];
+	webconfig_set_config_str("wifi_ps", mode_names[m]);
+	sprintf(buf, "%d", li);
+	webconfig_set_config_str("listen_int", buf);
+	portENTER_CRITICAL(&mux);
+	close_period(esp_timer_get_time());
+	mode=m;
+	portEXIT_CRITICAL(&mux);
+	if (li!=listen_int) {
+		//Only goes to the AP in the association request; the wifi manager reconnects by
+		//itself, using the STA config we changed here.
+		listen_int=li;
+		wifi_config_t *cfg=wifi_manager_get_wifi_sta_config();
+		cfg->sta.listen_interval=li;
+		esp_wifi_set_config(WIFI_IF_STA, cfg);
+		ESP_LOGI(TAG, "Listen interval changed, reassociating");
+		wifips_disconnected();
+		esp_wifi_disconnect();
+	} else {
+		wifips_apply();
+	}
+	return 1;
+}
+
+void wifips_add_rtt(uint32_t rtt_us) {
+	portENTER_CRITICAL(&mux);
+	wifips_mode_stats_t *s=&stats[mode];
+	s->rtt_samples++;
+	s->rtt_sum_us+=rtt_us;
+	if (rtt_us>s->rtt_max_us) s->rtt_max_us=rtt_us;
+	portEXIT_CRITICAL(&mux);
+}
+
+int wifips_get_stats(int *li, wifips_mode_stats_t st[WIFIPS_COUNT]) {
+	portENTER_CRITICAL(&mux);
+	close_period(esp_timer_get_time());
+	memcpy(st, stats, sizeof(stats));
+	int m=mode;
+	*li=listen_int;
+	portEXIT_CRITICAL(&mux);
+	return m;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <stdint.h>
+
+/*
+WiFi power save profile. Modem sleep saves power, but the radio only wakes up for every
+listen_int'th DTIM beacon, so a reply to an SNMP request can sit in the AP for up to that
+long. This sets the profile from the 'wifi_ps' and 'listen_int' settings, can change it
+without a reboot, and keeps SNMP RTT statistics and the time spent per profile, so the
+latency cost can be compared on site and matched against an external current meter.
+*/
+
+#define WIFIPS_NONE 0		//radio always on: lowest latency, no light sleep
+#define WIFIPS_MIN 1		//wake for every DTIM beacon
+#define WIFIPS_MAX 2		//wake every listen_int beacons
+#define WIFIPS_COUNT 3
+
+typedef struct {
+	uint64_t time_ms;		//time spent in this profile while connected
+	uint32_t rtt_samples;
+	uint64_t rtt_sum_us;
+	uint32_t rtt_max_us;
+} wifips_mode_stats_t;
+
+//Read the settings. Call before the wifi manager connects, as the listen interval is sent
+//to the AP when associating.
+void wifips_init();
+
+//Listen interval to put in the STA config, in beacon intervals.
+int wifips_listen_interval();
+
+//Apply the power save profile. Call when connected.
+void wifips_apply();
+
+//Stop accounting time to the profile until wifips_apply is called again.
+void wifips_disconnected();
+
+//Change the profile now, and save it. Changing the listen interval makes us reassociate.
+//Returns 0 if the mode name is invalid.
+int wifips_set(const char *mode, int listen_int);
+
+//Account an SNMP round trip time to the current profile.
+void wifips_add_rtt(uint32_t rtt_us);
+
+//Get the current profile and the stats of all profiles.
+int wifips_get_stats(int *listen_int, wifips_mode_stats_t st[WIFIPS_COUNT]);
+
+//Name of a profile, as used in the settings.
+const char *wifips_mode_name(int mode);
@@ -0,0 +1,213 @@
+/*
+Decodes a binary log, as downloaded from http://[device]/blog, using the ELF file of the
+firmware that produced it to look up the format strings. The log carries the start of
+the SHA256 of that ELF file; decoding against any other ELF turns every format string and
+%s argument into garbage, so that is refused unless -f is given.
+
+Usage: blog_decode [-f] firmware.elf blog.bin
+*/
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <elf.h>
+#include "blog.h"
+
+static uint8_t *elf;
+static long elf_len;
+
+static uint8_t *load_file(const char *fn, long *len) {
+	FILE *f=fopen(fn, "rb");
+	if (!f) {
+		perror(fn);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*len=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf=malloc(*len+1);
+	if (fread(buf, 1, *len, f)!=*len) {
+		perror(fn);
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+	buf[*len]=0;
+	fclose(f);
+	return buf;
+}
+
+//Minimal SHA256, only used to identify the ELF file.
+static const uint32_t sha_k[64]={
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x)>>(n))|((x)<<(32-(n))))
+
+static void sha256_block(uint32_t *h, const uint8_t *p) {
+	uint32_t w[64];
+	for (int i=0; i<16; i++) w[i]=(p[i*4]<<24)|(p[i*4+1]<<16)|(p[i*4+2]<<8)|p[i*4+3];
+	for (int i=16; i<64; i++) {
+		uint32_t s0=ROR(w[i-15], 7)^ROR(w[i-15], 18)^(w[i-15]>>3);
+		uint32_t s1=ROR(w[i-2], 17)^ROR(w[i-2], 19)^(w[i-2]>>10);
+		w[i]=w[i-16]+s0+w[i-7]+s1;
+	}
+	uint32_t v[8];
+	memcpy(v, h, sizeof(v));
+	for (int i=0; i<64; i++) {
+		uint32_t t1=v[7]+(ROR(v[4], 6)^ROR(v[4], 11)^ROR(v[4], 25))+((v[4]&v[5])^(~v[4]&v[6]))+sha_k[i]+w[i];
+		uint32_t t2=(ROR(v[0], 2)^ROR(v[0], 13)^ROR(v[0], 22))+((v[0]&v[1])^(v[0]&v[2])^(v[1]&v[2]));
+		memmove(&v[1], &v[0], 7*sizeof(uint32_t));
+		v[4]+=t1;
+		v[0]=t1+t2;
+	}
+	for (int i=0; i<8; i++) h[i]+=v[i];
+}
+
+static void sha256(const uint8_t *data, long len, uint8_t *out) {
+	uint32_t h[8]={0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	long i;
+	for (i=0; i+64<=len; i+=64) sha256_block(h, data+i);
+	uint8_t last[128]={0};
+	int rem=len-i;
+	memcpy(last, data+i, rem);
+	last[rem]=0x80;
+	int nb=(rem<56)?64:128;
+	uint64_t bits=(uint64_t)len*8;
+	for (int j=0; j<8; j++) last[nb-1-j]=bits>>(j*8);
+	for (int j=0; j<nb; j+=64) sha256_block(h, last+j);
+	for (int j=0; j<32; j++) out[j]=h[j/4]>>(24-(j%4)*8);
+}
+
+//Find the string the firmware had at address addr, by looking through the section headers.
+static const char *elf_str(uint32_t addr) {
+	Elf32_Ehdr *eh=(Elf32_Ehdr*)elf;
+	for (int i=0; i<eh->e_shnum; i++) {
+		Elf32_Shdr *sh=(Elf32_Shdr*)(elf+eh->e_shoff+i*eh->e_shentsize);
+		if (sh->sh_type!=SHT_PROGBITS || !(sh->sh_flags&SHF_ALLOC)) continue;
+		if (addr<sh->sh_addr || addr>=sh->sh_addr+sh->sh_size) continue;
+		long off=sh->sh_offset+(addr-sh->sh_addr);
+		if (off>=elf_len) return NULL;
+		return (const char*)elf+off;
+	}
+	return NULL;
+}
+
+//printf, but with the 32-bit arguments the firmware stored. %s arguments are addresses
+//of strings in the firmware.
+static void print_fmt(const char *fmt, const uint32_t *arg, int nargs) {
+	int a=0;
+	const char *p=fmt;
+	while (*p) {
+		if (*p!='%') {
+			putchar(*p++);
+			continue;
+		}
+		if (p[1]=='%') {
+			putchar('%');
+			p+=2;
+			continue;
+		}
+		//Copy the conversion spec, minus length modifiers: everything is 32-bit.
+		char spec[32];
+		int sl=0;
+		spec[sl++]=*p++;
+		while (*p && strchr("-+ #0123456789.", *p) && sl<20) spec[sl++]=*p++;
+		while (*p && strchr("hlzjt", *p)) p++;
+		if (!*p) break;
+		char conv=*p++;
+		spec[sl++]=conv;
+		spec[sl]=0;
+		uint32_t v=(a<nargs)?arg[a]:0;
+		a++;
+		if (conv=='s') {
+			const char *s=elf_str(v);
+			printf(spec, s?s:"<?>");
+		} else if (conv=='d' || conv=='i') {
+			printf(spec, (int32_t)v);
+		} else if (conv=='p') {
+			printf("0x%08x", v);
+		} else {
+			printf(spec, v);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	int force=0;
+	if (argc==4 && strcmp(argv[1], "-f")==0) {
+		force=1;
+		argc--;
+		argv++;
+	}
+	if (argc!=3) {
+		printf("Usage: %s [-f] firmware.elf blog.bin\n", argv[0]);
+		return 1;
+	}
+	elf=load_file(argv[1], &elf_len);
+	if (!elf) return 1;
+	if (elf_len<sizeof(Elf32_Ehdr) || memcmp(elf, ELFMAG, SELFMAG)!=0 || elf[EI_CLASS]!=ELFCLASS32) {
+		printf("%s: not a 32-bit ELF file\n", argv[1]);
+		return 1;
+	}
+	long len;
+	uint8_t *log=load_file(argv[2], &len);
+	if (!log) return 1;
+	blog_dump_hdr_t *hdr=(blog_dump_hdr_t*)log;
+	if (len<sizeof(*hdr) || hdr->magic!=BLOG_MAGIC || hdr->rec_size!=sizeof(blog_rec_t)) {
+		printf("%s: not a binary log, or from an incompatible firmware\n", argv[2]);
+		return 1;
+	}
+	//The firmware reports esp_app_desc_t.app_elf_sha256. That field is still zero in the
+	//ELF itself; esptool fills it in with the SHA256 of the ELF file when it makes the
+	//flash image, so hashing the file gives the same thing.
+	uint8_t sha[32];
+	char sha_hex[65];
+	sha256(elf, elf_len, sha);
+	for (int i=0; i<32; i++) sprintf(&sha_hex[i*2], "%02x", sha[i]);
+	if (strncmp(sha_hex, hdr->elf_sha, sizeof(hdr->elf_sha))!=0) {
+		fprintf(stderr, "%s: ELF sha256 %.16s... does not match the %.16s... this log was made with\n",
+				argv[1], sha_hex, hdr->elf_sha);
+		if (!force) {
+			fprintf(stderr, "Refusing to decode with the wrong ELF file; use -f to do it anyway.\n");
+			return 1;
+		}
+		fprintf(stderr, "WARNING: decoding anyway, format strings and %%s arguments will be garbage.\n");
+	}
+	printf("# firmware ELF sha256 %.16s..., %d records, %d dropped\n", hdr->elf_sha, hdr->nrec, hdr->dropped);
+	int n=(len-sizeof(*hdr))/sizeof(blog_rec_t);
+	if (n>hdr->nrec) n=hdr->nrec;
+	blog_rec_t *rec=(blog_rec_t*)(log+sizeof(*hdr));
+	//Timestamps are the lower 32 bits of the uptime; unwrap them.
+	uint64_t ts=0;
+	uint32_t last=0;
+	for (int i=0; i<n; i++) {
+		if (i==0) ts=rec[i].ts_us; else ts+=(uint32_t)(rec[i].ts_us-last);
+		last=rec[i].ts_us;
+		printf("%10.3f ", ts/1000.0);
+		const char *fmt=elf_str(rec[i].fmt);
+		if (fmt) {
+			print_fmt(fmt, rec[i].arg, rec[i].nargs);
+		} else {
+			printf("<unknown format 0x%08x>", rec[i].fmt);
+		}
+		if (rec[i].suppressed) printf(" [%d suppressed]", rec[i].suppressed);
+		printf("\n");
+	}
+	return 0;
+}
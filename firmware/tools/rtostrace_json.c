@@ -0,0 +1,188 @@
+/*
+Converts an RTOS trace, as downloaded from http://[device]/rtostrace, into Chrome trace
+JSON. Load the result in chrome://tracing or https://ui.perfetto.dev.
+
+Usage: rtostrace_json rtostrace.bin > trace.json
+
+Tasks show up as slices on one 'CPU' track, the cathode ISR on its own track, watched
+queue operations as instant events per queue and markers as slices (begin/end) or
+instant events per marker. Time 0 is the oldest event in the ring.
+*/
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain
+ * this notice you can do whatever you want with this stuff. If we meet some day,
+ * and you think this stuff is worth it, you can buy me a beer in return.
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "rtostrace.h"
+
+//Track (tid) numbers in the JSON
+#define TID_CPU 1
+#define TID_ISR 10
+#define TID_QUEUE 20
+#define TID_MARK 40
+
+static rtostrace_hdr_t hdr;
+static rtostrace_name_t *tasks, *queues, *isrs, *marks;
+static int first_ev=1;
+
+//Names come from the device and are at most RTOSTRACE_NAME_LEN-1 chars; make them safe
+//to put between quotes.
+static const char *esc(const char *s) {
+	static char buf[RTOSTRACE_NAME_LEN*2];
+	int p=0;
+	for (int i=0; s[i] && i<RTOSTRACE_NAME_LEN; i++) {
+		if (s[i]=='"' || s[i]=='\\') buf[p++]='\\';
+		buf[p++]=(s[i]<' ')?'?':s[i];
+	}
+	buf[p]=0;
+	return buf;
+}
+
+static const char *name_of(const rtostrace_name_t *names, int n, uint32_t id, const char *what) {
+	static char buf[32];
+	for (int i=0; i<n; i++) {
+		if (names[i].id==id && names[i].name[0]) return esc(names[i].name);
+	}
+	sprintf(buf, (id>0xffff)?"%s 0x%08x":"%s %u", what, id);
+	return buf;
+}
+
+static void ev_start() {
+	if (!first_ev) printf(",\n");
+	first_ev=0;
+}
+
+static void thread_name(int tid, const char *name) {
+	ev_start();
+	printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", tid, name);
+}
+
+static void slice(const char *name, char ph, int tid, double ts) {
+	ev_start();
+	printf("{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":0,\"tid\":%d,\"ts\":%.3f}", name, ph, tid, ts);
+}
+
+static void instant(const char *name, int tid, double ts, uint32_t val) {
+	ev_start();
+	printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"args\":{\"value\":%u}}",
+			name, tid, ts, val);
+}
+
+static rtostrace_name_t *read_names(FILE *f, int n) {
+	rtostrace_name_t *r=calloc(n?n:1, sizeof(rtostrace_name_t));
+	if (n && fread(r, sizeof(rtostrace_name_t), n, f)!=n) {
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+int main(int argc, char **argv) {
+	if (argc!=2) {
+		fprintf(stderr, "Usage: %s rtostrace.bin > trace.json\n", argv[0]);
+		return 1;
+	}
+	FILE *f=fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f)!=1 || hdr.magic!=RTOSTRACE_MAGIC) {
+		fprintf(stderr, "%s: not an RTOS trace\n", argv[1]);
+		return 1;
+	}
+	tasks=read_names(f, hdr.ntasks);
+	queues=read_names(f, hdr.nqueues);
+	isrs=read_names(f, hdr.nisrs);
+	marks=read_names(f, hdr.nmarks);
+	rtostrace_ev_t *evs=malloc((hdr.nev?hdr.nev:1)*sizeof(rtostrace_ev_t));
+	if (!tasks || !queues || !isrs || !marks || fread(evs, sizeof(rtostrace_ev_t), hdr.nev, f)!=hdr.nev) {
+		fprintf(stderr, "%s: truncated\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+	fprintf(stderr, "%u events, %u lost to the ring wrapping\n", hdr.nev, hdr.lost);
+
+	printf("{\"traceEvents\":[\n");
+	thread_name(TID_CPU, "CPU");
+	for (int i=0; i<hdr.nisrs; i++) thread_name(TID_ISR+i, name_of(isrs, hdr.nisrs, i, "ISR"));
+	for (int i=0; i<hdr.nqueues; i++) {
+		if (queues[i].name[0]) thread_name(TID_QUEUE+i, esc(queues[i].name));
+	}
+	for (int i=0; i<hdr.nmarks; i++) thread_name(TID_MARK+i, name_of(marks, hdr.nmarks, i, "marker"));
+
+	//Slices need a begin before their end; anything that started before the oldest event
+	//in the ring is left out, anything still open at the end gets closed there.
+	int isr_open[RTOSTRACE_ISR_COUNT]={0};
+	int mark_open[RTOSTRACE_MARK_COUNT]={0};
+	char task_open[64]="";
+	double ticks_per_us=hdr.ts_hz/1000000.0;
+	uint64_t ts=0;
+	double us=0;
+	for (int i=0; i<hdr.nev; i++) {
+		rtostrace_ev_t *e=&evs[i];
+		//Lower 32 bits of the timestamp; unsigned subtraction handles the wrap.
+		if (i>0) ts+=(uint32_t)(e->ts-evs[i-1].ts);
+		us=ts/ticks_per_us;
+		switch (e->type) {
+		case RTOSTRACE_EV_TASK_IN:
+			if (task_open[0]) slice(task_open, 'E', TID_CPU, us);
+			snprintf(task_open, sizeof(task_open), "%s", name_of(tasks, hdr.ntasks, e->arg, "task"));
+			slice(task_open, 'B', TID_CPU, us);
+			break;
+		case RTOSTRACE_EV_ISR_ENTER:
+		case RTOSTRACE_EV_ISR_EXIT:
+			if (e->id>=RTOSTRACE_ISR_COUNT) break;
+			if (e->type==RTOSTRACE_EV_ISR_ENTER || isr_open[e->id]) {
+				slice(name_of(isrs, hdr.nisrs, e->id, "ISR"), (e->type==RTOSTRACE_EV_ISR_ENTER)?'B':'E', TID_ISR+e->id, us);
+				isr_open[e->id]=(e->type==RTOSTRACE_EV_ISR_ENTER);
+			}
+			break;
+		case RTOSTRACE_EV_QUEUE_SEND:
+			instant("send", TID_QUEUE+e->id, us, e->arg);
+			break;
+		case RTOSTRACE_EV_QUEUE_RECV:
+			instant("receive", TID_QUEUE+e->id, us, e->arg);
+			break;
+		case RTOSTRACE_EV_QUEUE_BLOCK_SEND:
+			instant("blocked on send", TID_QUEUE+e->id, us, e->arg);
+			break;
+		case RTOSTRACE_EV_QUEUE_BLOCK_RECV:
+			instant("blocked on receive", TID_QUEUE+e->id, us, e->arg);
+			break;
+		case RTOSTRACE_EV_MARK:
+			instant(name_of(marks, hdr.nmarks, e->id, "marker"), TID_MARK+e->id, us, e->arg);
+			break;
+		case RTOSTRACE_EV_MARK_BEGIN:
+		case RTOSTRACE_EV_MARK_END:
+			if (e->id>=RTOSTRACE_MARK_COUNT) break;
+			if (e->type==RTOSTRACE_EV_MARK_BEGIN || mark_open[e->id]) {
+				slice(name_of(marks, hdr.nmarks, e->id, "marker"), (e->type==RTOSTRACE_EV_MARK_BEGIN)?'B':'E', TID_MARK+e->id, us);
+				mark_open[e->id]=(e->type==RTOSTRACE_EV_MARK_BEGIN);
+			}
+			break;
+		case RTOSTRACE_EV_TRIGGER:
+			ev_start();
+			printf("{\"name\":\"late cathode step\",\"ph\":\"i\",\"s\":\"g\",\"pid\":0,\"tid\":%d,\"ts\":%.3f}", TID_CPU, us);
+			break;
+		default:
+			fprintf(stderr, "Unknown event type %d\n", e->type);
+		}
+	}
+	if (task_open[0]) slice(task_open, 'E', TID_CPU, us);
+	for (int i=0; i<RTOSTRACE_ISR_COUNT; i++) {
+		if (isr_open[i]) slice(name_of(isrs, hdr.nisrs, i, "ISR"), 'E', TID_ISR+i, us);
+	}
+	for (int i=0; i<RTOSTRACE_MARK_COUNT; i++) {
+		if (mark_open[i]) slice(name_of(marks, hdr.nmarks, i, "marker"), 'E', TID_MARK+i, us);
+	}
+	printf("\n]}\n");
+	return 0;
+}
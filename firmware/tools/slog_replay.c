@@ -0,0 +1,191 @@
+/*
+Replays a sample trace, as downloaded from http://[device]/trace, through the same rate and
+spin speed calculations the firmware uses. It prints what the firmware should have done,
+and checks that against the spin commands in the trace.
+
+Usage: slog_replay [-m max_bw_bps] [-q] [-b iterations] trace.bin
+  -m: max bandwidth, as configured on the device (default 1G)
+  -q: don't print every sample
+  -b: benchmark; replay the samples this many times and print the time it takes
+*/
+/*
+ * ----------------------------------------------------------------------------
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * Jeroen Domburg <jeroen@spritesmods.com> wrote this file. As long as you retain 
+ * this notice you can do whatever you want with this stuff. If we meet some day, 
+ * and you think this stuff is worth it, you can buy me a beer in return. 
+ * ----------------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "samplelog.h"
+#include "ratecalc.h"
+#include "ctrlock.h"
+#include "dekatron.h"
+
+//A sample record, with the time made monotonic.
+typedef struct {
+	int64_t ts_us;
+	uint16_t boot;
+	slog_rec_t rec;
+} ev_t;
+
+static ev_t *evs;
+static int nev=0;
+
+static int load(const char *fn) {
+	FILE *f=fopen(fn, "rb");
+	if (!f) {
+		perror(fn);
+		return 0;
+	}
+	uint8_t sector[SLOG_SECTOR_SIZE];
+	int cap=0;
+	int64_t ts=0;
+	uint32_t last_ts32=0;
+	int last_boot=-1;
+	uint32_t last_seq=0;
+	while (fread(sector, SLOG_SECTOR_SIZE, 1, f)==1) {
+		slog_hdr_t *hdr=(slog_hdr_t*)sector;
+		if (hdr->magic==0xffffffff) continue; //erased
+		if (hdr->magic!=SLOG_MAGIC || hdr->rec_size!=sizeof(slog_rec_t)) {
+			fprintf(stderr, "Skipping invalid sector\n");
+			continue;
+		}
+		if (last_boot!=-1 && hdr->seq!=last_seq+1) {
+			fprintf(stderr, "Gap in trace: sector seq %u follows %u\n", hdr->seq, last_seq);
+		}
+		last_seq=hdr->seq;
+		slog_rec_t *recs=(slog_rec_t*)(sector+sizeof(slog_hdr_t));
+		for (int i=0; i<SLOG_RECS_PER_SECTOR; i++) {
+			if (recs[i].type==SLOG_REC_EMPTY) break;
+			if (nev==cap) {
+				cap=cap?cap*2:1024;
+				evs=realloc(evs, cap*sizeof(ev_t));
+			}
+			if (hdr->boot!=last_boot) {
+				//New boot; timestamps start over.
+				last_boot=hdr->boot;
+				last_ts32=recs[i].ts_us;
+			}
+			//Timestamps are the lower 32 bits; unsigned subtraction handles the wrap.
+			ts+=(uint32_t)(recs[i].ts_us-last_ts32);
+			last_ts32=recs[i].ts_us;
+			evs[nev].ts_us=ts;
+			evs[nev].boot=hdr->boot;
+			evs[nev].rec=recs[i];
+			nev++;
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+//Replays the trace. Returns the amount of spin commands that don't match the replay.
+static int replay(uint64_t max_bw, int verbose, int *samples, int *checked) {
+	ratecalc_t rc={0};
+	ctrlock_t cl={0};
+	int last_boot=-1;
+	int have_delay=0, delay_us=0, ccw=0, delay_in_us=0, delay_out_us=0;
+	int mismatch=0;
+	*samples=0;
+	*checked=0;
+	for (int i=0; i<nev; i++) {
+		slog_rec_t *r=&evs[i].rec;
+		if (evs[i].boot!=last_boot) {
+			memset(&rc, 0, sizeof(rc));
+			memset(&cl, 0, sizeof(cl));
+			have_delay=0;
+			last_boot=evs[i].boot;
+			if (verbose) printf("# boot %d\n", last_boot);
+		}
+		if (r->type==SLOG_REC_SAMPLE) {
+			if (verbose) {
+				printf("%.3f sample in=%u%s out=%u%s rtt %.1f/%.1f ms%s\n", evs[i].ts_us/1000000.0,
+					r->a, (r->flags&SLOG_FLAG_IN_OK)?"":" (failed)",
+					r->b, (r->flags&SLOG_FLAG_OUT_OK)?"":" (failed)",
+					r->rtt_in/10.0, r->rtt_out/10.0, (r->flags&SLOG_FLAG_ALIASED)?" aliased":"");
+			}
+			if ((r->flags&(SLOG_FLAG_IN_OK|SLOG_FLAG_OUT_OK))!=(SLOG_FLAG_IN_OK|SLOG_FLAG_OUT_OK)) continue;
+			//Skip the samples the firmware would have skipped; the firmware feeds ctrlock the
+			//same samples, so it comes to the same conclusions.
+			if (!ctrlock_sample(&cl, evs[i].ts_us, r->a, r->b)) continue;
+			snmpgetter_bw_t bw;
+			//Firmware timestamps are never 0, so offset them to keep ratecalc happy.
+			if (ratecalc_update(&rc, evs[i].ts_us+1, r->a, r->b, &bw)) {
+				delay_us=ratecalc_spin_delay_us(&bw, max_bw/8, &ccw);
+				delay_in_us=ratecalc_glow_delay_us(bw.bps_in, max_bw/8);
+				delay_out_us=ratecalc_glow_delay_us(bw.bps_out, max_bw/8);
+				have_delay=1;
+				(*samples)++;
+				if (verbose) printf("    -> in %d B/s out %d B/s, spin %s delay %d us\n",
+						bw.bps_in, bw.bps_out, ccw?"ccw":"cw", delay_us);
+			}
+		} else if (r->type==SLOG_REC_ANIM) {
+			int type=r->a>>16;
+			int subtype=(int16_t)(r->a&0xffff);
+			if (verbose) printf("%.3f anim type %d subtype %d speed %d us duration %d ms\n",
+					evs[i].ts_us/1000000.0, type, subtype, (int)r->b, (int)r->c);
+			if (type==DEKA_ANIM_TYPE_SPIN && have_delay && r->c==0) {
+				(*checked)++;
+				if ((int)r->b!=delay_us || subtype!=ccw) {
+					mismatch++;
+					if (verbose) printf("    MISMATCH: replay says %s delay %d us\n", ccw?"ccw":"cw", delay_us);
+				}
+			} else if (type==DEKA_ANIM_TYPE_DUAL && have_delay) {
+				//Dual glow records carry both delays instead of a duration.
+				(*checked)++;
+				if ((int)r->b!=delay_out_us || (int)r->c!=delay_in_us) {
+					mismatch++;
+					if (verbose) printf("    MISMATCH: replay says cw %d us ccw %d us\n", delay_out_us, delay_in_us);
+				}
+			}
+		} else if (r->type==SLOG_REC_FLUSH) {
+			if (verbose) printf("%.3f anim flush\n", evs[i].ts_us/1000000.0);
+		}
+	}
+	return mismatch;
+}
+
+int main(int argc, char **argv) {
+	uint64_t max_bw=ratecalc_parse_bw("1G");
+	int verbose=1;
+	int bench=0;
+	int opt;
+	while ((opt=getopt(argc, argv, "m:qb:"))!=-1) {
+		if (opt=='m') {
+			max_bw=ratecalc_parse_bw(optarg);
+		} else if (opt=='q') {
+			verbose=0;
+		} else if (opt=='b') {
+			bench=atoi(optarg);
+		} else {
+			fprintf(stderr, "Usage: %s [-m max_bw_bps] [-q] [-b iterations] trace.bin\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind>=argc || max_bw==0) {
+		fprintf(stderr, "Usage: %s [-m max_bw_bps] [-q] [-b iterations] trace.bin\n", argv[0]);
+		return 1;
+	}
+	if (!load(argv[optind])) return 1;
+
+	int samples, checked;
+	int mismatch=replay(max_bw, verbose, &samples, &checked);
+	printf("%d records, %d rate samples, %d spin commands checked, %d mismatches\n",
+			nev, samples, checked, mismatch);
+
+	if (bench>0) {
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int i=0; i<bench; i++) replay(max_bw, 0, &samples, &checked);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		double ns=(t1.tv_sec-t0.tv_sec)*1e9+(t1.tv_nsec-t0.tv_nsec);
+		printf("Benchmark: %d iterations, %.1f ns per record\n", bench, ns/bench/(nev?nev:1));
+	}
+	return mismatch?2:0;
+}